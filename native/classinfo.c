@@ -0,0 +1,224 @@
+#include "classinfo.h"
+
+#include <stdlib.h>
+
+#include "pyjava.h"
+
+
+/*
+ * The registry maps System.identityHashCode() of a class to the chain of
+ * ClassInfo records with that hash (as a PyCObject). The hash is only a hint,
+ * IsSameObject() tells which record is the right one.
+ */
+static PyObject *registry = NULL;
+
+void classinfo_init(void)
+{
+    registry = PyDict_New();
+}
+
+ClassInfo *classinfo_get(jclass javaclass)
+{
+    ClassInfo *info;
+    ClassInfo *first = NULL;
+    PyObject *key = PyInt_FromLong(java_identity_hash(javaclass));
+    PyObject *chain = PyDict_GetItem(registry, key); /* borrowed */
+
+    if(chain != NULL)
+    {
+        first = PyCObject_AsVoidPtr(chain);
+        for(info = first; info != NULL; info = info->next)
+        {
+            if((*penv)->IsSameObject(penv, info->javaclass, javaclass))
+            {
+                Py_DECREF(key);
+                return info;
+            }
+        }
+    }
+
+    /* This class hasn't been seen yet, create a record */
+    info = malloc(sizeof(ClassInfo));
+    info->javaclass = (*penv)->NewGlobalRef(penv, javaclass);
+    info->methods = PyDict_New();
+    info->fields = PyDict_New();
+    info->assignable = PyDict_New();
+    info->complete = 0;
+    info->pytype = NULL;
+
+    /* Insert it at the head of the chain */
+    info->next = first;
+    chain = PyCObject_FromVoidPtr(info, NULL);
+    PyDict_SetItem(registry, key, chain);
+    Py_DECREF(chain);
+    Py_DECREF(key);
+
+    return info;
+}
+
+static void methods_destructor(void *methods)
+{
+    java_decref_methods((java_Methods*)methods);
+}
+
+java_Methods *classinfo_get_methods(ClassInfo *info, PyObject *name,
+        int what)
+{
+    java_Methods *methods;
+    PyObject *entry = PyDict_GetItem(info->methods, name); /* borrowed */
+
+    if(entry == NULL && info->complete)
+        return NULL;
+    else if(entry == NULL)
+    {
+        /* First time this name is requested: list the overloads, and
+         * remember if there are none */
+        methods = java_list_methods(info->javaclass,
+                                    PyString_AS_STRING(name),
+                                    FIELD_BOTH);
+        if(methods != NULL)
+            entry = PyCObject_FromVoidPtr(methods, methods_destructor);
+        else
+        {
+            entry = Py_None;
+            Py_INCREF(entry);
+        }
+        PyDict_SetItem(info->methods, name, entry);
+        Py_DECREF(entry);
+    }
+
+    if(entry == Py_None)
+        return NULL;
+    methods = PyCObject_AsVoidPtr(entry);
+    if(!(methods->what & what))
+        return NULL;
+    return methods;
+}
+
+static void field_destructor(void *field)
+{
+    java_free_field((java_Field*)field);
+}
+
+java_Field *classinfo_get_field(ClassInfo *info, PyObject *name)
+{
+    PyObject *entry = PyDict_GetItem(info->fields, name); /* borrowed */
+
+    if(entry == NULL && info->complete)
+        return NULL;
+    else if(entry == NULL)
+    {
+        java_Field *field = java_get_field(info->javaclass,
+                                           PyString_AS_STRING(name));
+        if(field != NULL)
+            entry = PyCObject_FromVoidPtr(field, field_destructor);
+        else
+        {
+            entry = Py_None;
+            Py_INCREF(entry);
+        }
+        PyDict_SetItem(info->fields, name, entry);
+        Py_DECREF(entry);
+    }
+
+    if(entry == Py_None)
+        return NULL;
+    return PyCObject_AsVoidPtr(entry);
+}
+
+void classinfo_load(ClassInfo *info)
+{
+    size_t nb, i;
+    char **names;
+    java_Methods **lists;
+
+    if(info->complete)
+        return ;
+
+    nb = java_list_all_methods(info->javaclass, &names, &lists);
+    for(i = 0; i < nb; ++i)
+    {
+        PyObject *name = PyString_FromString(names[i]);
+        /* Keep the lists that were already handed out */
+        if(PyDict_GetItem(info->methods, name) == NULL)
+        {
+            PyObject *entry = PyCObject_FromVoidPtr(lists[i],
+                                                    methods_destructor);
+            PyDict_SetItem(info->methods, name, entry);
+            Py_DECREF(entry);
+        }
+        else
+            java_decref_methods(lists[i]);
+        Py_DECREF(name);
+        free(names[i]);
+    }
+    free(names);
+    free(lists);
+
+    nb = java_list_field_names(info->javaclass, &names);
+    for(i = 0; i < nb; ++i)
+    {
+        PyObject *name = PyString_FromString(names[i]);
+        classinfo_get_field(info, name);
+        Py_DECREF(name);
+        free(names[i]);
+    }
+    free(names);
+
+    info->complete = 1;
+}
+
+/*
+ * An entry of the assignability cache. It keeps a reference to the other
+ * class: the key is only the address of the caller's reference, which can be
+ * reused for another class once deleted.
+ */
+typedef struct _S_AssignableEntry {
+    jclass javatype; /* global reference */
+    char result;
+} AssignableEntry;
+
+static unsigned long assignable_cache_hits = 0;
+static unsigned long assignable_cache_misses = 0;
+
+static void assignable_destructor(void *v_entry)
+{
+    AssignableEntry *entry = v_entry;
+    (*penv)->DeleteGlobalRef(penv, entry->javatype);
+    free(entry);
+}
+
+int classinfo_is_subclass(ClassInfo *info, jclass javatype)
+{
+    AssignableEntry *entry;
+    PyObject *key = PyLong_FromVoidPtr(javatype);
+    PyObject *cobj = PyDict_GetItem(info->assignable, key); /* borrowed */
+
+    if(cobj != NULL)
+    {
+        entry = PyCObject_AsVoidPtr(cobj);
+        if((*penv)->IsSameObject(penv, entry->javatype, javatype))
+        {
+            assignable_cache_hits++;
+            Py_DECREF(key);
+            return entry->result;
+        }
+    }
+
+    assignable_cache_misses++;
+    entry = malloc(sizeof(AssignableEntry));
+    entry->javatype = (*penv)->NewGlobalRef(penv, javatype);
+    entry->result = java_is_subclass(info->javaclass, javatype);
+    cobj = PyCObject_FromVoidPtr(entry, assignable_destructor);
+    PyDict_SetItem(info->assignable, key, cobj);
+    Py_DECREF(cobj);
+    Py_DECREF(key);
+    return entry->result;
+}
+
+void classinfo_stats(PyObject *dict)
+{
+    pyjava_add_counter(dict, "assignable_cache_hits", assignable_cache_hits);
+    pyjava_add_counter(dict, "assignable_cache_misses",
+                       assignable_cache_misses);
+}
@@ -0,0 +1,103 @@
+#ifndef CLASSINFO_H
+#define CLASSINFO_H
+
+#include <Python.h>
+#include <jni.h>
+
+#include "java.h"
+
+
+/**
+ * Metadata cached for a Java class.
+ *
+ * These records are built once, the first time a class is looked up through
+ * classinfo_get(), and are never freed; they keep a global reference on the
+ * class, which thus never gets unloaded.
+ */
+typedef struct _S_ClassInfo {
+    jclass javaclass;
+    /* Overloads by name: PyCObject wrapping a java_Methods, or None if the
+     * class has no such method */
+    PyObject *methods;
+    /* Fields by name: PyCObject wrapping a java_Field, or None if the class
+     * has no such field */
+    PyObject *fields;
+    /* Whether this class is assignable to other classes: maps the address of
+     * a reference to the other class to a PyCObject */
+    PyObject *assignable;
+    /* Whether all the methods and fields have been loaded; if so, a name
+     * missing from the dicts is known not to exist */
+    char complete;
+
+    /* The Python type generated for this class, or NULL if it hasn't been
+     * created yet; see javawrapper_wrap_class() */
+    PyObject *pytype;
+
+    struct _S_ClassInfo *next; /* next record with the same identity hash */
+} ClassInfo;
+
+
+/**
+ * Initialization method.
+ *
+ * To be called AFTER java_init() has succeeded.
+ */
+void classinfo_init(void);
+
+
+/**
+ * Returns the metadata record for a Java class, creating it if needed.
+ */
+ClassInfo *classinfo_get(jclass javaclass);
+
+
+/**
+ * Returns the overloads of the named method.
+ *
+ * The list is only computed the first time a name is requested, further calls
+ * return the same list. It is returned as a borrowed reference; use
+ * java_incref_methods() if you want to keep it.
+ *
+ * @param what Kinds of methods that are wanted (FIELD_STATIC and/or
+ * FIELD_NONSTATIC); NULL is returned if no overload is of the requested kind.
+ */
+java_Methods *classinfo_get_methods(ClassInfo *info, PyObject *name,
+        int what);
+
+
+/**
+ * Loads all the public methods and fields of the class.
+ *
+ * Afterwards, the methods and fields dicts hold every member of the class and
+ * lookups of other names no longer go through Java.
+ */
+void classinfo_load(ClassInfo *info);
+
+
+/**
+ * Returns the named public field, or NULL if there is none.
+ *
+ * Like methods, the field is looked up only once, whether it is found or not.
+ */
+java_Field *classinfo_get_field(ClassInfo *info, PyObject *name);
+
+
+/**
+ * Checks whether a class is a subclass (or the same, or implement) of another.
+ *
+ * This is java_is_subclass() with a cache: the result for a given
+ * (info, javatype) pair is only asked to Java once.
+ *
+ * @return 1 if it is.
+ */
+int classinfo_is_subclass(ClassInfo *info, jclass javatype);
+
+
+/**
+ * Adds the statistics of this module to a dictionary.
+ *
+ * Used by _pyjava.stats().
+ */
+void classinfo_stats(PyObject *dict);
+
+#endif
@@ -1,78 +1,217 @@
 #include "convert.h"
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "classinfo.h"
 #include "java.h"
 #include "javawrapper.h"
+#include "pyjava.h"
 
-enum CVT_JType {
-    CVT_J_VOID,
-    CVT_J_BOOLEAN,
-    CVT_J_BYTE,
-    CVT_J_CHAR,
-    CVT_J_SHORT,
-    CVT_J_INT,
-    CVT_J_LONG,
-    CVT_J_FLOAT,
-    CVT_J_DOUBLE,
-    CVT_J_OBJECT
-};
-#define NB_JPTYPES 9
-#define NB_JTYPES 10
-#define JTYPE_PRIMITIVE(t) ((t) != CVT_J_OBJECT)
-
-static jclass jptypes[NB_JPTYPES];
-static const char *jptypes_classes[NB_JPTYPES] = {
-    "java/lang/Void",
-    "java/lang/Boolean",
-    "java/lang/Byte",
-    "java/lang/Character",
-    "java/lang/Short",
-    "java/lang/Integer",
-    "java/lang/Long",
-    "java/lang/Float",
-    "java/lang/Double"
-};
+/*
+ * Primitive arrays from Python buffers.
+ *
+ * An object exporting a contiguous buffer with a matching format can be passed
+ * where an array of a primitive type is expected. A new Java array is created
+ * and filled with a single Set<Type>ArrayRegion(); if the object was wrapped
+ * with _pyjava.inout(), the content of the array is copied back into the
+ * buffer after the call (see convert_py2jav_release()).
+ */
 
-void convert_init(void)
+/**
+ * Returns the type of the elements if javatype is an array of a primitive
+ * type, else CVT_J_VOID.
+ */
+static enum CVT_JType primitive_array_type(jclass javatype)
 {
-    size_t i;
-    for(i = 0; i < NB_JPTYPES; ++i)
+    enum CVT_JType type = CVT_J_VOID;
+    jclass component = java_get_component_type(javatype);
+    if(component != NULL)
     {
-        jclass clasz = (*penv)->FindClass(penv, jptypes_classes[i]);
-        jfieldID field = (*penv)->GetStaticFieldID(
-                penv, clasz, "TYPE", "Ljava/lang/Class;");
-        jptypes[i] = (*penv)->GetStaticObjectField(penv, clasz, field);
+        type = java_id_type(component);
+        (*penv)->DeleteLocalRef(penv, component);
+        if(type == CVT_J_OBJECT)
+            type = CVT_J_VOID;
     }
+    return type;
 }
 
-static enum CVT_JType convert_id_type(jclass javatype)
+/**
+ * Checks that the items of a buffer have the representation of the given
+ * primitive type.
+ *
+ * Integers of either signedness are accepted, the bits are copied as-is.
+ */
+static int buffer_matches(const Py_buffer *view, enum CVT_JType type)
 {
-    char primitive = (*penv)->CallBooleanMethod(
-            penv,
-            javatype, meth_Class_isPrimitive) == JNI_TRUE;
+    const char *format = (view->format != NULL)?view->format:"B";
+    if(format[0] == '@' || format[0] == '=')
+        format++;
+    if(format[0] == '\0' || format[1] != '\0')
+        return 0;
+    if((size_t)view->itemsize != java_primitive_size(type))
+        return 0;
+    switch(type)
+    {
+    case CVT_J_BOOLEAN:
+        return format[0] == '?';
+    case CVT_J_FLOAT:
+        return format[0] == 'f';
+    case CVT_J_DOUBLE:
+        return format[0] == 'd';
+    default:
+        return strchr("cbBhHiIlLqQ", format[0]) != NULL;
+    }
+}
+
+/**
+ * Gets the buffer of an object that is to be passed as an array.
+ *
+ * @param elemtype Where to store the type of the elements.
+ * @return 1 with view filled in if the object can be passed as the given
+ * array class, else 0 (no exception is set).
+ */
+static int convert_get_array_buffer(PyObject *pyobj, jclass javatype,
+        Py_buffer *view, enum CVT_JType *elemtype)
+{
+    int flags = PyBUF_FORMAT | PyBUF_ND; /* C-contiguous */
+    PyObject *target = javawrapper_unwrap_inout(pyobj);
+    if(target != NULL)
+    {
+        pyobj = target;
+        flags |= PyBUF_WRITABLE;
+    }
 
-    if(primitive)
+    /* unicode objects get converted to String instead */
+    if(!PyObject_CheckBuffer(pyobj) || PyUnicode_Check(pyobj))
+        return 0;
+    *elemtype = primitive_array_type(javatype);
+    if(*elemtype == CVT_J_VOID)
+        return 0;
+    if(PyObject_GetBuffer(pyobj, view, flags) < 0)
+    {
+        PyErr_Clear();
+        return 0;
+    }
+    if(!buffer_matches(view, *elemtype))
     {
-        size_t i;
-        for(i = 0; i < NB_JPTYPES; ++i)
+        PyBuffer_Release(view);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Creates a Java array from a buffer obtained from convert_get_array_buffer().
+ */
+static jarray convert_buffer_to_array(const Py_buffer *view,
+        enum CVT_JType elemtype)
+{
+    jsize length = view->len / view->itemsize;
+    jarray array = java_new_array(elemtype, length);
+    if(array != NULL)
+        java_set_array_region(array, elemtype, 0, length, view->buf);
+    return array;
+}
+
+/*
+ * Direct ByteBuffers on Python memory.
+ *
+ * A writable buffer can be shared with Java as a direct ByteBuffer (see
+ * _pyjava.bytebuffer()), which is also done implicitly for parameters and
+ * fields declared as ByteBuffer or Buffer. The Python buffer stays exported
+ * while the ByteBuffer is alive: each shared buffer keeps a weak reference to
+ * its ByteBuffer, and is released once the JVM has collected it.
+ */
+
+typedef struct _S_SharedBuffer {
+    jweak javabuffer;
+    Py_buffer view;
+    struct _S_SharedBuffer *next;
+} SharedBuffer;
+
+static SharedBuffer *shared_buffers = NULL;
+static unsigned long shared_buffers_live = 0;
+
+/**
+ * Releases the Python buffers whose ByteBuffer has been collected.
+ */
+static void shared_buffers_sweep(void)
+{
+    SharedBuffer **prev = &shared_buffers;
+    while(*prev != NULL)
+    {
+        SharedBuffer *shared = *prev;
+        if((*penv)->IsSameObject(penv, shared->javabuffer, NULL))
         {
-            if((*penv)->CallBooleanMethod(
-                    penv,
-                    javatype, meth_Object_equals, jptypes[i]) != JNI_FALSE)
-                return i;
+            *prev = shared->next;
+            (*penv)->DeleteWeakGlobalRef(penv, shared->javabuffer);
+            PyBuffer_Release(&shared->view);
+            free(shared);
+            shared_buffers_live--;
         }
-        assert(0); /* can't happen */
-        return 0;
+        else
+            prev = &shared->next;
     }
-    else
-        return CVT_J_OBJECT;
 }
 
-int convert_check_py2jav(PyObject *pyobj, jclass javatype)
+jobject convert_share_buffer(PyObject *pyobj)
 {
-    enum CVT_JType type = convert_id_type(javatype);
+    jobject javabuffer;
+    SharedBuffer *shared = malloc(sizeof(SharedBuffer));
+
+    shared_buffers_sweep();
 
+    if(PyObject_GetBuffer(pyobj, &shared->view,
+                          PyBUF_WRITABLE | PyBUF_ND) < 0)
+    {
+        free(shared);
+        return NULL;
+    }
+    javabuffer = (*penv)->NewDirectByteBuffer(penv,
+                                              shared->view.buf,
+                                              shared->view.len);
+    if(javabuffer == NULL)
+    {
+        (*penv)->ExceptionClear(penv);
+        PyBuffer_Release(&shared->view);
+        free(shared);
+        PyErr_SetString(
+                Err_Base,
+                "The JVM doesn't support direct buffers");
+        return NULL;
+    }
+    shared->javabuffer = (*penv)->NewWeakGlobalRef(penv, javabuffer);
+    shared->next = shared_buffers;
+    shared_buffers = shared;
+    shared_buffers_live++;
+    return javabuffer;
+}
+
+/**
+ * Checks whether an object can be shared as a direct ByteBuffer for the given
+ * declared class.
+ */
+static int convert_check_shared_buffer(PyObject *pyobj, jclass javatype)
+{
+    Py_buffer view;
+    if(!PyObject_CheckBuffer(pyobj) || PyUnicode_Check(pyobj))
+        return 0;
+    if(!(*penv)->IsSameObject(penv, javatype, class_ByteBuffer)
+     && !(*penv)->IsSameObject(penv, javatype, class_Buffer))
+        return 0;
+    if(PyObject_GetBuffer(pyobj, &view, PyBUF_WRITABLE | PyBUF_ND) < 0)
+    {
+        PyErr_Clear();
+        return 0;
+    }
+    PyBuffer_Release(&view);
+    return 1;
+}
+
+int convert_check_py2jav(PyObject *pyobj, enum CVT_JType type,
+        jclass javatype)
+{
     if(JTYPE_PRIMITIVE(type))
     {
         char long_status;
@@ -130,18 +269,33 @@ int convert_check_py2jav(PyObject *pyobj, jclass javatype)
         return 1;
     else
     {
-        /* Checks that pyobj is a JavaInstance and unwraps the jclass */
-        jclass passed_class;
+        /* Checks that pyobj is a JavaInstance and gets its class */
+        ClassInfo *passed_class;
         if(javawrapper_unwrap_instance(pyobj, NULL, &passed_class))
         {
             /* Check that the passed object has a class that is subclass of the
              * wanted class */
-            return java_is_subclass(passed_class, javatype);
+            return classinfo_is_subclass(passed_class, javatype);
         }
         else
         {
+            Py_buffer view;
+            enum CVT_JType elemtype;
+
             /* Special case: We can convert a unicode object to String */
-            if(java_equals(javatype, class_String) && PyUnicode_Check(pyobj))
+            if(PyUnicode_Check(pyobj)
+             && (*penv)->IsSameObject(penv, javatype, class_String))
+                return 1;
+
+            /* Buffers can be passed as arrays of primitive types */
+            if(convert_get_array_buffer(pyobj, javatype, &view, &elemtype))
+            {
+                PyBuffer_Release(&view);
+                return 1;
+            }
+
+            /* Writable buffers can be shared as ByteBuffers */
+            if(convert_check_shared_buffer(pyobj, javatype))
                 return 1;
         }
 
@@ -151,10 +305,132 @@ int convert_check_py2jav(PyObject *pyobj, jclass javatype)
     return 0;
 }
 
-void convert_py2jav(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+/*
+ * String conversions.
+ *
+ * Strings go directly between the internal storage of Python's unicode objects
+ * and Java's UTF-16. If Python uses 16-bit characters, that is a single copy.
+ * Else, characters outside the BMP are encoded as (or decoded from) surrogate
+ * pairs; strings without any (e.g. ASCII) are simply widened or narrowed.
+ */
+
+#define STRING_STACK_CHARS 256
+
+/**
+ * Creates a Java String from a unicode object.
+ *
+ * @return A local reference, or NULL with MemoryError set.
+ */
+static jstring convert_unicode_to_jstring(PyObject *unicode)
 {
-    enum CVT_JType type = convert_id_type(javatype);
+    Py_ssize_t len = PyUnicode_GET_SIZE(unicode);
+    const Py_UNICODE *src = PyUnicode_AS_UNICODE(unicode);
+#if Py_UNICODE_SIZE == 2
+    jstring str = (*penv)->NewString(penv, (const jchar*)src, len);
+    if(str == NULL)
+    {
+        (*penv)->ExceptionClear(penv); /* OutOfMemoryError */
+        PyErr_NoMemory();
+    }
+    return str;
+#else
+    jchar stack_buf[STRING_STACK_CHARS];
+    jchar *buf = stack_buf;
+    jsize n = 0;
+    Py_ssize_t i;
+    jstring str;
+
+    /* Each character takes at most two UTF-16 units */
+    if(len * 2 > STRING_STACK_CHARS)
+    {
+        buf = malloc(sizeof(jchar) * len * 2);
+        if(buf == NULL)
+        {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    for(i = 0; i < len; ++i)
+    {
+        Py_UCS4 c = src[i];
+        if(c < 0x10000)
+            buf[n++] = c;
+        else
+        {
+            c -= 0x10000;
+            buf[n++] = 0xD800 | (c >> 10);
+            buf[n++] = 0xDC00 | (c & 0x3FF);
+        }
+    }
+    str = (*penv)->NewString(penv, buf, n);
+    if(buf != stack_buf)
+        free(buf);
+    if(str == NULL)
+    {
+        (*penv)->ExceptionClear(penv); /* OutOfMemoryError */
+        PyErr_NoMemory();
+    }
+    return str;
+#endif
+}
 
+static PyObject *convert_jstring_to_unicode(jstring str)
+{
+    jsize len = (*penv)->GetStringLength(penv, str);
+    PyObject *unicode = PyUnicode_FromUnicode(NULL, len);
+    if(unicode == NULL)
+        return NULL;
+#if Py_UNICODE_SIZE == 2
+    (*penv)->GetStringRegion(penv, str, 0, len,
+                             (jchar*)PyUnicode_AS_UNICODE(unicode));
+#else
+    {
+        /* The characters are copied out rather than accessed in a critical
+         * region: decoding can allocate, and so run the garbage collector,
+         * which might call back into JNI */
+        Py_UNICODE *dest = PyUnicode_AS_UNICODE(unicode);
+        jsize i;
+        jchar stack_buf[STRING_STACK_CHARS];
+        jchar *chars = stack_buf;
+        if(len > STRING_STACK_CHARS)
+        {
+            chars = malloc(sizeof(jchar) * len);
+            if(chars == NULL)
+            {
+                Py_DECREF(unicode);
+                return PyErr_NoMemory();
+            }
+        }
+        (*penv)->GetStringRegion(penv, str, 0, len, chars);
+        for(i = 0; i < len; ++i)
+        {
+            if((chars[i] & 0xF800) == 0xD800)
+                break; /* surrogate */
+            dest[i] = chars[i];
+        }
+        if(i < len)
+        {
+            /* Decode the pairs; Java strings might also contain unpaired
+             * surrogates, which get replaced */
+#ifdef WORDS_BIGENDIAN
+            int byteorder = 1;
+#else
+            int byteorder = -1;
+#endif
+            Py_DECREF(unicode);
+            unicode = PyUnicode_DecodeUTF16((const char*)chars, len * 2,
+                                            "replace", &byteorder);
+        }
+        if(chars != stack_buf)
+            free(chars);
+    }
+#endif
+    return unicode;
+}
+
+int convert_py2jav(PyObject *pyobj, enum CVT_JType type, jclass javatype,
+        jvalue *javavalue)
+{
     if(JTYPE_PRIMITIVE(type))
     {
         switch(type)
@@ -200,262 +476,684 @@ void convert_py2jav(PyObject *pyobj, jclass javatype, jvalue *javavalue)
         javavalue->l = NULL;
     else
     {
+        Py_buffer view;
+        enum CVT_JType elemtype;
+
         if(javawrapper_unwrap_instance(pyobj, &javavalue->l, NULL))
-            return ;
-        else
+            return 1;
+        else if(PyUnicode_Check(pyobj))
         {
             /* Special case: String objects can be created from unicode, which
              * makes sense. They can get converted back when received from
              * Java. */
-            PyObject *pyutf8 = PyUnicode_AsUTF8String(pyobj);
-            const char *utf8 = PyString_AsString(pyutf8);
-            size_t size = PyString_GET_SIZE(pyutf8);
-            javavalue->l = java_from_utf8(utf8, size);
-            Py_DECREF(pyutf8);
+            javavalue->l = convert_unicode_to_jstring(pyobj);
+            if(javavalue->l == NULL)
+                return 0;
+        }
+        else if(convert_get_array_buffer(pyobj, javatype, &view, &elemtype))
+        {
+            javavalue->l = convert_buffer_to_array(&view, elemtype);
+            PyBuffer_Release(&view);
+        }
+        else
+        {
+            /* convert_check_py2jav() accepted it */
+            javavalue->l = convert_share_buffer(pyobj);
+            if(javavalue->l == NULL)
+                return 0;
         }
     }
+    return 1;
 }
 
-PyObject *convert_calljava(jobject self, jmethodID method,
-        jvalue *parameters, jclass returntype)
+void convert_py2jav_release(PyObject *pyobj, enum CVT_JType type,
+        jvalue *javavalue)
 {
-    enum CVT_JType type = convert_id_type(returntype);
+    PyObject *target;
 
-    switch(type)
+    if(type != CVT_J_OBJECT || pyobj == Py_None || javavalue->l == NULL
+     || javawrapper_unwrap_instance(pyobj, NULL, NULL))
+        return ;
+
+    /* Arrays passed for inout() buffers are copied back; the item size was
+     * checked against the array type, so this is a plain copy */
+    target = javawrapper_unwrap_inout(pyobj);
+    if(target != NULL)
     {
-    case CVT_J_VOID:
-        (*penv)->CallVoidMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-        Py_INCREF(Py_None);
-        return Py_None;
-    case CVT_J_BOOLEAN:
+        Py_buffer view;
+        if(PyObject_GetBuffer(target, &view,
+                              PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_ND) == 0)
         {
-            jboolean ret = (*penv)->CallBooleanMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            if(ret == JNI_FALSE)
+            Py_ssize_t size = (*penv)->GetArrayLength(penv, javavalue->l)
+                    * view.itemsize;
+            void *elements = (*penv)->GetPrimitiveArrayCritical(
+                    penv, javavalue->l, NULL);
+            if(elements != NULL)
             {
-                Py_INCREF(Py_False);
-                return Py_False;
+                memcpy(view.buf, elements, (size < view.len)?size:view.len);
+                (*penv)->ReleasePrimitiveArrayCritical(
+                        penv, javavalue->l, elements, JNI_ABORT);
             }
             else
-            {
-                Py_INCREF(Py_True);
-                return Py_True;
-            }
+                (*penv)->ExceptionClear(penv);
+            PyBuffer_Release(&view);
         }
-    case CVT_J_BYTE:
-        {
-            jbyte ret = (*penv)->CallByteMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyInt_FromLong(ret);
-        }
-    case CVT_J_CHAR:
-        {
-            jchar ret = (*penv)->CallCharMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyUnicode_FromFormat("%c", (int)ret);
-        }
-    case CVT_J_SHORT:
-        {
-            jshort ret = (*penv)->CallShortMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyInt_FromLong(ret);
-        }
-    case CVT_J_INT:
-        {
-            jint ret = (*penv)->CallIntMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyInt_FromLong(ret);
-        }
-    case CVT_J_LONG:
-        {
-            jlong ret = (*penv)->CallLongMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyLong_FromLongLong(ret);
-        }
-    case CVT_J_FLOAT:
-        {
-            jfloat ret = (*penv)->CallFloatMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyFloat_FromDouble(ret);
-        }
-    case CVT_J_DOUBLE:
-        {
-            jdouble ret = (*penv)->CallDoubleMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            return PyFloat_FromDouble(ret);
-        }
-    case CVT_J_OBJECT:
-        {
-            jobject ret = (*penv)->CallObjectMethodA(
-                    penv,
-                    self, method,
-                    parameters);
-            if(ret == NULL)
-            {
-                Py_INCREF(Py_None);
-                return Py_None;
-            }
-            else if(java_equals(java_getclass(ret), class_String))
-            {
-                /* Special case: String objects get converted to unicode, which
-                 * makes sense. They can get converted back if need be. */
-                size_t size;
-                char *utf8 = java_to_utf8(ret, &size);
-                PyObject *unicode = PyUnicode_FromStringAndSize(
-                        utf8,
-                        size);
-                free(utf8);
-                return unicode;
-            }
-            else
-                return javawrapper_wrap_instance(ret);
-        }
-    default:
-        assert(0); /* can't happen */
-        return NULL;
+        else
+            PyErr_Clear();
     }
+
+    (*penv)->DeleteLocalRef(penv, javavalue->l);
 }
 
-PyObject *convert_calljava_static(jclass javaclass, jmethodID method,
-        jvalue *parameters, jclass returntype)
+/*
+ * Argument converters, for callers that already know the parameter types (see
+ * convert_argfunc()). Instead of convert_check_py2jav() and convert_py2jav(),
+ * each only checks what is required for the conversion to be safe, and raises
+ * TypeError if it isn't.
+ */
+
+static int argfunc_error(PyObject *pyobj, const char *expected)
 {
-    enum CVT_JType type = convert_id_type(returntype);
+    PyErr_Format(
+            PyExc_TypeError,
+            "expected %s, got %.200s",
+            expected, Py_TYPE(pyobj)->tp_name);
+    return 0;
+}
 
-    switch(type)
+static int argfunc_integer(PyObject *pyobj, long min, long max,
+        const char *expected, long *value)
+{
+    if(!PyInt_Check(pyobj) && !PyLong_Check(pyobj))
+        return argfunc_error(pyobj, expected);
+    *value = PyInt_AsLong(pyobj);
+    if(*value == -1 && PyErr_Occurred())
+        return 0;
+    if(*value < min || *value > max)
     {
-    case CVT_J_VOID:
-        (*penv)->CallStaticVoidMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-        Py_INCREF(Py_None);
-        return Py_None;
-    case CVT_J_BOOLEAN:
+        PyErr_Format(
+                PyExc_OverflowError,
+                "value out of range for Java %s",
+                expected);
+        return 0;
+    }
+    return 1;
+}
+
+static int argfunc_boolean(PyObject *pyobj, jclass javatype,
+        jvalue *javavalue)
+{
+    if(!PyBool_Check(pyobj))
+        return argfunc_error(pyobj, "boolean");
+    javavalue->z = (pyobj == Py_True)?JNI_TRUE:JNI_FALSE;
+    return 1;
+}
+
+static int argfunc_byte(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+{
+    long value;
+    if(!argfunc_integer(pyobj, 0, 255, "byte", &value))
+        return 0;
+    javavalue->b = value;
+    return 1;
+}
+
+static int argfunc_char(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+{
+    if(PyString_Check(pyobj) && PyString_GET_SIZE(pyobj) == 1)
+        javavalue->c = PyString_AS_STRING(pyobj)[0];
+    else if(PyUnicode_Check(pyobj) && PyUnicode_GET_SIZE(pyobj) == 1)
+        javavalue->c = PyUnicode_AS_UNICODE(pyobj)[0];
+    else
+        return argfunc_error(pyobj, "char");
+    return 1;
+}
+
+static int argfunc_short(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+{
+    long value;
+    if(!argfunc_integer(pyobj, -32768, 32767, "short", &value))
+        return 0;
+    javavalue->s = value;
+    return 1;
+}
+
+static int argfunc_int(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+{
+    long value;
+    if(!argfunc_integer(pyobj, -2147483647L - 1, 2147483647L, "int", &value))
+        return 0;
+    javavalue->i = value;
+    return 1;
+}
+
+static int argfunc_long(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+{
+    PY_LONG_LONG value;
+    if(!PyInt_Check(pyobj) && !PyLong_Check(pyobj))
+        return argfunc_error(pyobj, "long");
+    value = PyLong_AsLongLong(pyobj);
+    if(value == -1 && PyErr_Occurred())
+        return 0;
+    javavalue->j = value;
+    return 1;
+}
+
+static int argfunc_float(PyObject *pyobj, jclass javatype, jvalue *javavalue)
+{
+    double value;
+    if(!PyNumber_Check(pyobj))
+        return argfunc_error(pyobj, "float");
+    value = PyFloat_AsDouble(pyobj);
+    if(value == -1.0 && PyErr_Occurred())
+        return 0;
+    javavalue->f = value;
+    return 1;
+}
+
+static int argfunc_double(PyObject *pyobj, jclass javatype,
+        jvalue *javavalue)
+{
+    double value;
+    if(!PyNumber_Check(pyobj))
+        return argfunc_error(pyobj, "double");
+    value = PyFloat_AsDouble(pyobj);
+    if(value == -1.0 && PyErr_Occurred())
+        return 0;
+    javavalue->d = value;
+    return 1;
+}
+
+static int argfunc_object(PyObject *pyobj, jclass javatype,
+        jvalue *javavalue)
+{
+    ClassInfo *info;
+    if(pyobj == Py_None)
+        javavalue->l = NULL;
+    else if(javawrapper_unwrap_instance(pyobj, &javavalue->l, &info))
+    {
+        /* Passing an object of the wrong class would crash the JVM */
+        if(!classinfo_is_subclass(info, javatype))
+            return argfunc_error(pyobj, "Java object of the declared class");
+    }
+    else if(PyUnicode_Check(pyobj)
+          && (*penv)->IsSameObject(penv, javatype, class_String))
+    {
+        javavalue->l = convert_unicode_to_jstring(pyobj);
+        if(javavalue->l == NULL)
+            return 0;
+    }
+    else
+    {
+        Py_buffer view;
+        enum CVT_JType elemtype;
+        if(convert_get_array_buffer(pyobj, javatype, &view, &elemtype))
         {
-            jboolean ret = (*penv)->CallStaticBooleanMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            if(ret == JNI_FALSE)
-            {
-                Py_INCREF(Py_False);
-                return Py_False;
-            }
-            else
+            javavalue->l = convert_buffer_to_array(&view, elemtype);
+            PyBuffer_Release(&view);
+            if(javavalue->l == NULL)
             {
-                Py_INCREF(Py_True);
-                return Py_True;
+                PyErr_NoMemory();
+                return 0;
             }
         }
-    case CVT_J_BYTE:
-        {
-            jbyte ret = (*penv)->CallStaticByteMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyInt_FromLong(ret);
-        }
-    case CVT_J_CHAR:
-        {
-            jchar ret = (*penv)->CallStaticCharMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyUnicode_FromFormat("%c", (int)ret);
-        }
-    case CVT_J_SHORT:
-        {
-            jshort ret = (*penv)->CallStaticShortMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyInt_FromLong(ret);
-        }
-    case CVT_J_INT:
-        {
-            jint ret = (*penv)->CallStaticIntMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyInt_FromLong(ret);
-        }
-    case CVT_J_LONG:
-        {
-            jlong ret = (*penv)->CallStaticLongMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyLong_FromLongLong(ret);
-        }
-    case CVT_J_FLOAT:
-        {
-            jfloat ret = (*penv)->CallStaticFloatMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyFloat_FromDouble(ret);
-        }
-    case CVT_J_DOUBLE:
-        {
-            jdouble ret = (*penv)->CallStaticDoubleMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            return PyFloat_FromDouble(ret);
-        }
-    case CVT_J_OBJECT:
+        else if(convert_check_shared_buffer(pyobj, javatype))
         {
-            jobject ret = (*penv)->CallStaticObjectMethodA(
-                    penv,
-                    javaclass, method,
-                    parameters);
-            if(ret == NULL)
-            {
-                Py_INCREF(Py_None);
-                return Py_None;
-            }
-            else if(java_equals(java_getclass(ret), class_String))
-            {
-                /* Special case: String objects get converted to unicode, which
-                 * makes sense. They can get converted back if need be. */
-                size_t size;
-                char *utf8 = java_to_utf8(ret, &size);
-                PyObject *unicode = PyUnicode_FromStringAndSize(
-                        utf8,
-                        size);
-                free(utf8);
-                return unicode;
-            }
-            else
-                return javawrapper_wrap_instance(ret);
+            javavalue->l = convert_share_buffer(pyobj);
+            if(javavalue->l == NULL)
+                return 0;
         }
-    default:
-        assert(0); /* can't happen */
-        return NULL;
+        else
+            return argfunc_error(pyobj, "Java object");
+    }
+    return 1;
+}
+
+static const convert_ArgFunc argfuncs[NB_JTYPES] = {
+    NULL, /* no parameter is void */
+    argfunc_boolean,
+    argfunc_byte,
+    argfunc_char,
+    argfunc_short,
+    argfunc_int,
+    argfunc_long,
+    argfunc_float,
+    argfunc_double,
+    argfunc_object
+};
+
+convert_ArgFunc convert_argfunc(enum CVT_JType type)
+{
+    return argfuncs[type];
+}
+
+PyObject *convert_jobject_result(jobject ret,
+        enum JAVA_ResultKind kind)
+{
+    PyObject *result;
+    if(ret == NULL)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    /* String is final, so IsInstanceOf() is an exact class check */
+    else if(kind == JAVA_RESULT_STRING
+         || (kind == JAVA_RESULT_CHECK
+          && (*penv)->IsInstanceOf(penv, ret, class_String)))
+    {
+        /* Special case: String objects get converted to unicode, which
+         * makes sense. They can get converted back if need be. */
+        result = convert_jstring_to_unicode(ret);
+    }
+    else
+        result = javawrapper_wrap_instance(ret);
+    (*penv)->DeleteLocalRef(penv, ret);
+    return result;
+}
+
+PyObject *convert_java_exception(void)
+{
+    jthrowable exception = (*penv)->ExceptionOccurred(penv);
+    jstring message;
+    PyObject *pymessage = NULL;
+    (*penv)->ExceptionClear(penv);
+
+    message = (*penv)->CallObjectMethod(penv, exception, meth_Object_toString);
+    if(message != NULL)
+    {
+        pymessage = convert_jstring_to_unicode(message);
+        (*penv)->DeleteLocalRef(penv, message);
+    }
+    else
+        (*penv)->ExceptionClear(penv);
+    if(pymessage == NULL)
+    {
+        PyErr_Clear();
+        pymessage = PyString_FromString("Java exception");
+    }
+
+    if((*penv)->IsInstanceOf(penv, exception, class_InterruptedException))
+        PyErr_SetObject(Err_Interrupted, pymessage);
+    else
+        PyErr_SetObject(Err_JavaException, pymessage);
+    Py_DECREF(pymessage);
+    (*penv)->DeleteLocalRef(penv, exception);
+    return NULL;
+}
+
+int convert_release_gil = 1;
+
+/* Runs a JNI call, without the GIL if release_gil is set, and returns from
+ * the calling function if it threw */
+#define CALL_JAVA(call) do { \
+        if(release_gil) \
+        { \
+            Py_BEGIN_ALLOW_THREADS \
+            call; \
+            Py_END_ALLOW_THREADS \
+        } \
+        else \
+            call; \
+        if((*penv)->ExceptionCheck(penv)) \
+            return convert_java_exception(); \
+    } while(0)
+
+static PyObject *calljava_void(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    CALL_JAVA((*penv)->CallVoidMethodA(
+            penv,
+            self, method,
+            parameters));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *calljava_boolean(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jboolean ret;
+    CALL_JAVA(ret = (*penv)->CallBooleanMethodA(
+            penv,
+            self, method,
+            parameters));
+    if(ret == JNI_FALSE)
+    {
+        Py_INCREF(Py_False);
+        return Py_False;
     }
+    else
+    {
+        Py_INCREF(Py_True);
+        return Py_True;
+    }
+}
+
+static PyObject *calljava_byte(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jbyte ret;
+    CALL_JAVA(ret = (*penv)->CallByteMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyInt_FromLong(ret);
+}
+
+static PyObject *calljava_char(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jchar ret;
+    CALL_JAVA(ret = (*penv)->CallCharMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyUnicode_FromFormat("%c", (int)ret);
+}
+
+static PyObject *calljava_short(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jshort ret;
+    CALL_JAVA(ret = (*penv)->CallShortMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyInt_FromLong(ret);
+}
+
+static PyObject *calljava_int(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jint ret;
+    CALL_JAVA(ret = (*penv)->CallIntMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyInt_FromLong(ret);
+}
+
+static PyObject *calljava_long(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jlong ret;
+    CALL_JAVA(ret = (*penv)->CallLongMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyLong_FromLongLong(ret);
+}
+
+static PyObject *calljava_float(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jfloat ret;
+    CALL_JAVA(ret = (*penv)->CallFloatMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyFloat_FromDouble(ret);
+}
+
+static PyObject *calljava_double(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jdouble ret;
+    CALL_JAVA(ret = (*penv)->CallDoubleMethodA(
+            penv,
+            self, method,
+            parameters));
+    return PyFloat_FromDouble(ret);
+}
+
+static PyObject *calljava_object(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jobject ret;
+    CALL_JAVA(ret = (*penv)->CallObjectMethodA(
+            penv,
+            self, method,
+            parameters));
+    return convert_jobject_result(ret, JAVA_RESULT_WRAP);
+}
+
+static PyObject *calljava_string(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jobject ret;
+    CALL_JAVA(ret = (*penv)->CallObjectMethodA(
+            penv,
+            self, method,
+            parameters));
+    return convert_jobject_result(ret, JAVA_RESULT_STRING);
+}
+
+static PyObject *calljava_anyobject(jobject self, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jobject ret;
+    CALL_JAVA(ret = (*penv)->CallObjectMethodA(
+            penv,
+            self, method,
+            parameters));
+    return convert_jobject_result(ret, JAVA_RESULT_CHECK);
+}
+
+static const convert_CallFunc calljava_funcs[NB_JTYPES] = {
+    calljava_void,
+    calljava_boolean,
+    calljava_byte,
+    calljava_char,
+    calljava_short,
+    calljava_int,
+    calljava_long,
+    calljava_float,
+    calljava_double,
+    calljava_object
+};
+
+/* Object results, by JAVA_ResultKind */
+static const convert_CallFunc calljava_object_funcs[NB_JRESULTS] = {
+    calljava_object,
+    calljava_string,
+    calljava_anyobject
+};
+
+static PyObject *calljava_static_void(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    CALL_JAVA((*penv)->CallStaticVoidMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *calljava_static_boolean(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jboolean ret;
+    CALL_JAVA(ret = (*penv)->CallStaticBooleanMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    if(ret == JNI_FALSE)
+    {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+    else
+    {
+        Py_INCREF(Py_True);
+        return Py_True;
+    }
+}
+
+static PyObject *calljava_static_byte(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jbyte ret;
+    CALL_JAVA(ret = (*penv)->CallStaticByteMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyInt_FromLong(ret);
+}
+
+static PyObject *calljava_static_char(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jchar ret;
+    CALL_JAVA(ret = (*penv)->CallStaticCharMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyUnicode_FromFormat("%c", (int)ret);
+}
+
+static PyObject *calljava_static_short(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jshort ret;
+    CALL_JAVA(ret = (*penv)->CallStaticShortMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyInt_FromLong(ret);
+}
+
+static PyObject *calljava_static_int(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jint ret;
+    CALL_JAVA(ret = (*penv)->CallStaticIntMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyInt_FromLong(ret);
+}
+
+static PyObject *calljava_static_long(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jlong ret;
+    CALL_JAVA(ret = (*penv)->CallStaticLongMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyLong_FromLongLong(ret);
+}
+
+static PyObject *calljava_static_float(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jfloat ret;
+    CALL_JAVA(ret = (*penv)->CallStaticFloatMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyFloat_FromDouble(ret);
+}
+
+static PyObject *calljava_static_double(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jdouble ret;
+    CALL_JAVA(ret = (*penv)->CallStaticDoubleMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return PyFloat_FromDouble(ret);
+}
+
+static PyObject *calljava_static_object(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jobject ret;
+    CALL_JAVA(ret = (*penv)->CallStaticObjectMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return convert_jobject_result(ret, JAVA_RESULT_WRAP);
+}
+
+static PyObject *calljava_static_string(jclass javaclass, jmethodID method,
+        jvalue *parameters, int release_gil)
+{
+    jobject ret;
+    CALL_JAVA(ret = (*penv)->CallStaticObjectMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return convert_jobject_result(ret, JAVA_RESULT_STRING);
+}
+
+static PyObject *calljava_static_anyobject(jclass javaclass,
+        jmethodID method, jvalue *parameters, int release_gil)
+{
+    jobject ret;
+    CALL_JAVA(ret = (*penv)->CallStaticObjectMethodA(
+            penv,
+            javaclass, method,
+            parameters));
+    return convert_jobject_result(ret, JAVA_RESULT_CHECK);
+}
+
+static const convert_CallFunc calljava_static_funcs[NB_JTYPES] = {
+    calljava_static_void,
+    calljava_static_boolean,
+    calljava_static_byte,
+    calljava_static_char,
+    calljava_static_short,
+    calljava_static_int,
+    calljava_static_long,
+    calljava_static_float,
+    calljava_static_double,
+    calljava_static_object
+};
+
+static const convert_CallFunc calljava_static_object_funcs[NB_JRESULTS] = {
+    calljava_static_object,
+    calljava_static_string,
+    calljava_static_anyobject
+};
+
+PyObject *convert_calljava(jobject self, jmethodID method,
+        jvalue *parameters, enum CVT_JType returntype,
+        enum JAVA_ResultKind kind)
+{
+    return convert_callfunc(returntype, kind)(self, method, parameters,
+                                              convert_release_gil);
+}
+
+convert_CallFunc convert_callfunc(enum CVT_JType returntype,
+        enum JAVA_ResultKind kind)
+{
+    if(returntype == CVT_J_OBJECT)
+        return calljava_object_funcs[kind];
+    return calljava_funcs[returntype];
+}
+
+PyObject *convert_calljava_static(jclass javaclass, jmethodID method,
+        jvalue *parameters, enum CVT_JType returntype,
+        enum JAVA_ResultKind kind)
+{
+    return convert_callstaticfunc(returntype, kind)(javaclass, method,
+                                                    parameters,
+                                                    convert_release_gil);
+}
+
+convert_CallFunc convert_callstaticfunc(enum CVT_JType returntype,
+        enum JAVA_ResultKind kind)
+{
+    if(returntype == CVT_J_OBJECT)
+        return calljava_static_object_funcs[kind];
+    return calljava_static_funcs[returntype];
 }
 
 static PyObject *convert_getjavainstfield(jobject object, jfieldID id,
-        enum CVT_JType type)
+        enum CVT_JType type, enum JAVA_ResultKind kind)
 {
     switch(type)
     {
@@ -538,25 +1236,7 @@ static PyObject *convert_getjavainstfield(jobject object, jfieldID id,
                     penv,
                     object,
                     id);
-            if(ret == NULL)
-            {
-                Py_INCREF(Py_None);
-                return Py_None;
-            }
-            else if(java_equals(java_getclass(ret), class_String))
-            {
-                /* Special case: String objects get converted to unicode, which
-                 * makes sense. They can get converted back if need be. */
-                size_t size;
-                char *utf8 = java_to_utf8(ret, &size);
-                PyObject *unicode = PyUnicode_FromStringAndSize(
-                        utf8,
-                        size);
-                free(utf8);
-                return unicode;
-            }
-            else
-                return javawrapper_wrap_instance(ret);
+            return convert_jobject_result(ret, kind);
         }
     case CVT_J_VOID:
     default:
@@ -566,7 +1246,7 @@ static PyObject *convert_getjavainstfield(jobject object, jfieldID id,
 }
 
 static PyObject *convert_getjavastaticfield(jclass javaclass, jfieldID id,
-        enum CVT_JType type)
+        enum CVT_JType type, enum JAVA_ResultKind kind)
 {
     switch(type)
     {
@@ -649,25 +1329,7 @@ static PyObject *convert_getjavastaticfield(jclass javaclass, jfieldID id,
                     penv,
                     javaclass,
                     id);
-            if(ret == NULL)
-            {
-                Py_INCREF(Py_None);
-                return Py_None;
-            }
-            else if(java_equals(java_getclass(ret), class_String))
-            {
-                /* Special case: String objects get converted to unicode, which
-                 * makes sense. They can get converted back if need be. */
-                size_t size;
-                char *utf8 = java_to_utf8(ret, &size);
-                PyObject *unicode = PyUnicode_FromStringAndSize(
-                        utf8,
-                        size);
-                free(utf8);
-                return unicode;
-            }
-            else
-                return javawrapper_wrap_instance(ret);
+            return convert_jobject_result(ret, kind);
         }
     case CVT_J_VOID:
     default:
@@ -677,72 +1339,29 @@ static PyObject *convert_getjavastaticfield(jclass javaclass, jfieldID id,
 }
 
 PyObject *convert_getjavafield(jclass javaclass, jobject object,
-        const char *name, int type)
+        const java_Field *field, int type)
 {
-    jobject javafield;
-    jclass javatype;
-    jint modifiers;
-    char is_static;
-    jstring javaname = java_from_utf8(name, strlen(name));
-
     /* object can't be null if the nonstatic fields are requested */
     assert(object != NULL || !(type & FIELD_NONSTATIC));
 
-    javafield = (*penv)->CallObjectMethod(
-            penv,
-            javaclass,
-            meth_Class_getField,
-            javaname);
-    (*penv)->DeleteLocalRef(penv, javaname);
-
-    if(javafield == NULL)
-    {
-        (*penv)->ExceptionClear(penv);
+    if(field == NULL)
         return NULL; /* no field with that name */
-    }
 
-    modifiers = (*penv)->CallIntMethod(
-            penv,
-            javafield, meth_Field_getModifiers);
-    is_static = (*penv)->CallStaticBooleanMethod(
-            penv,
-            class_Modifier, meth_Modifier_isStatic,
-            modifiers) != JNI_FALSE;
-
-    if( (is_static && !(type & FIELD_STATIC))
-     || (!is_static && !(type & FIELD_NONSTATIC)) )
-    {
-        (*penv)->DeleteLocalRef(penv, javafield);
+    if( (field->is_static && !(type & FIELD_STATIC))
+     || (!field->is_static && !(type & FIELD_NONSTATIC)) )
         return NULL; /* field doesn't have the required type */
-    }
-
-    javatype = (*penv)->CallObjectMethod(
-            penv,
-            javafield,
-            meth_Field_getType);
-
-    {
-        jfieldID id = (*penv)->FromReflectedField(penv, javafield);
-        enum CVT_JType type = convert_id_type(javatype);
-        PyObject *pyobj;
-
-        if(!is_static)
-            pyobj = convert_getjavainstfield(object, id, type);
-        else
-            pyobj = convert_getjavastaticfield(javaclass, id, type);
-
-        (*penv)->DeleteLocalRef(penv, javafield);
-        (*penv)->DeleteLocalRef(penv, javatype);
 
-        return pyobj;
-    }
+    if(!field->is_static)
+        return convert_getjavainstfield(object, field->id, field->type,
+                                        field->kind);
+    else
+        return convert_getjavastaticfield(javaclass, field->id, field->type,
+                                          field->kind);
 }
 
-static void convert_setjavainstfield(jobject object, jclass javatype,
-        jfieldID id, PyObject *pyobj)
+static int convert_setjavainstfield(jobject object, enum CVT_JType type,
+        jclass javatype, jfieldID id, PyObject *pyobj)
 {
-    enum CVT_JType type = convert_id_type(javatype);
-
     if(JTYPE_PRIMITIVE(type))
     {
         switch(type)
@@ -792,29 +1411,19 @@ static void convert_setjavainstfield(jobject object, jclass javatype,
         (*penv)->SetObjectField(penv, object, id, NULL);
     else
     {
-        jobject javaobj;
-        if(javawrapper_unwrap_instance(pyobj, &javaobj, NULL))
-            (*penv)->SetObjectField(penv, object, id, javaobj);
-        else
-        {
-            /* Special case: String objects can be created from unicode, which
-             * makes sense. They can get converted back when received from
-             * Java. */
-            PyObject *pyutf8 = PyUnicode_AsUTF8String(pyobj);
-            const char *utf8 = PyString_AsString(pyutf8);
-            size_t size = PyString_GET_SIZE(pyutf8);
-            (*penv)->SetObjectField(penv, object, id,
-                                    java_from_utf8(utf8, size));
-            Py_DECREF(pyutf8);
-        }
+        /* Strings and arrays are created from Python objects */
+        jvalue value;
+        if(!convert_py2jav(pyobj, CVT_J_OBJECT, javatype, &value))
+            return 0;
+        (*penv)->SetObjectField(penv, object, id, value.l);
+        convert_py2jav_release(pyobj, CVT_J_OBJECT, &value);
     }
+    return 1;
 }
 
-static void convert_setjavastaticfield(jclass javaclass, jclass javatype,
-        jfieldID id, PyObject *pyobj)
+static int convert_setjavastaticfield(jclass javaclass,
+        enum CVT_JType type, jclass javatype, jfieldID id, PyObject *pyobj)
 {
-    enum CVT_JType type = convert_id_type(javatype);
-
     if(JTYPE_PRIMITIVE(type))
     {
         switch(type)
@@ -870,85 +1479,45 @@ static void convert_setjavastaticfield(jclass javaclass, jclass javatype,
         (*penv)->SetStaticObjectField(penv, javaclass, id, NULL);
     else
     {
-        jobject javaobj;
-        if(javawrapper_unwrap_instance(pyobj, &javaobj, NULL))
-            (*penv)->SetStaticObjectField(penv, javaclass, id, javaobj);
-        else
-        {
-            /* Special case: String objects can be created from unicode, which
-             * makes sense. They can get converted back when received from
-             * Java. */
-            PyObject *pyutf8 = PyUnicode_AsUTF8String(pyobj);
-            const char *utf8 = PyString_AsString(pyutf8);
-            size_t size = PyString_GET_SIZE(pyutf8);
-            (*penv)->SetStaticObjectField(penv, javaclass, id,
-                                          java_from_utf8(utf8, size));
-            Py_DECREF(pyutf8);
-        }
+        /* Strings and arrays are created from Python objects */
+        jvalue value;
+        if(!convert_py2jav(pyobj, CVT_J_OBJECT, javatype, &value))
+            return 0;
+        (*penv)->SetStaticObjectField(penv, javaclass, id, value.l);
+        convert_py2jav_release(pyobj, CVT_J_OBJECT, &value);
     }
+    return 1;
 }
 
 int convert_setjavafield(jclass javaclass, jobject object,
-        const char *name, int type, PyObject *value)
+        const java_Field *field, int type, PyObject *value)
 {
-    jobject javafield;
-    jclass javatype;
-    jint modifiers;
-    char is_static;
-    jstring javaname = java_from_utf8(name, strlen(name));
-
     /* object can't be null if the nonstatic fields are requested */
     assert(object != NULL || !(type & FIELD_NONSTATIC));
 
-    javafield = (*penv)->CallObjectMethod(
-            penv,
-            javaclass,
-            meth_Class_getField,
-            javaname);
-    (*penv)->DeleteLocalRef(penv, javaname);
-
-    if(javafield == NULL)
-    {
-        (*penv)->ExceptionClear(penv);
+    if(field == NULL)
         return -1; /* no field with that name */
-    }
 
-    modifiers = (*penv)->CallIntMethod(
-            penv,
-            javafield, meth_Field_getModifiers);
-    is_static = (*penv)->CallStaticBooleanMethod(
-            penv,
-            class_Modifier, meth_Modifier_isStatic,
-            modifiers) != JNI_FALSE;
-
-    if( (is_static && !(type & FIELD_STATIC))
-     || (!is_static && !(type & FIELD_NONSTATIC)) )
-    {
-        (*penv)->DeleteLocalRef(penv, javafield);
+    if( (field->is_static && !(type & FIELD_STATIC))
+     || (!field->is_static && !(type & FIELD_NONSTATIC)) )
         return 0; /* field doesn't have the required type */
-    }
 
-    javatype = (*penv)->CallObjectMethod(
-            penv,
-            javafield,
-            meth_Field_getType);
-
-    {
-        int success = 0;
-        if(convert_check_py2jav(value, javatype))
-        {
-            /* Field type is compatible */
-            jfieldID id = (*penv)->FromReflectedField(penv, javafield);
-            if(!is_static)
-                convert_setjavainstfield(object, javatype, id, value);
-            else
-                convert_setjavastaticfield(javaclass, javatype, id, value);
-            success = 1;
-        }
+    if(!convert_check_py2jav(value, field->type, field->javatype))
+        return 0;
 
-        (*penv)->DeleteLocalRef(penv, javafield);
-        (*penv)->DeleteLocalRef(penv, javatype);
+    /* Field type is compatible */
+    if(!field->is_static)
+        return convert_setjavainstfield(object, field->type, field->javatype,
+                                        field->id, value)?1:-2;
+    else
+        return convert_setjavastaticfield(javaclass, field->type,
+                                          field->javatype, field->id,
+                                          value)?1:-2;
+}
 
-        return success;
-    }
+void convert_stats(PyObject *dict)
+{
+    /* Don't report buffers that could be released already */
+    shared_buffers_sweep();
+    pyjava_add_counter(dict, "shared_buffers", shared_buffers_live);
 }
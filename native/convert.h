@@ -4,79 +4,197 @@
 #include <Python.h>
 #include <jni.h>
 
-
-/**
- * Initialization method.
- *
- * To be called AFTER java_start_vm() has succeeded.
- */
-void convert_init(void);
+#include "java.h"
 
 /**
  * Indicate whether a given Python object can be implicitely converted (or
  * wrapped) as a Java object as the given type.
  *
+ * The type is given both as a type code (see java_id_type()) and as a class,
+ * which is only used for objects.
+ *
  * Will return 1 if:
  *  - Both types are the same primitive type
  *  - Both types are compatible primitive types (int can be casted to float,
  *    for example)
  *  - The Python object is a JavaInstance from a subclass of the javatype
  *    (which is either a class or an interface)
+ *  - The type is an array of a primitive type and the Python object exports
+ *    a contiguous buffer of items of that type (possibly through
+ *    _pyjava.inout())
+ *  - The type is ByteBuffer or Buffer and the Python object exports a
+ *    contiguous writable buffer, which gets shared (see
+ *    convert_share_buffer())
  */
-int convert_check_py2jav(PyObject *pyobj, jclass javatype);
+int convert_check_py2jav(PyObject *pyobj, enum CVT_JType type,
+        jclass javatype);
 
 /**
  * Convert a given Python object as a Java object of the given type.
  *
- * See convert_check_py2jav() for what is acceptable.
+ * See convert_check_py2jav() for what is acceptable. Objects might get
+ * created (String from unicode, arrays from buffers); call
+ * convert_py2jav_release() once the value is no longer needed.
+ *
+ * @return 1 on success, 0 with an exception set if the conversion failed
+ * (sharing a buffer as a ByteBuffer can); nothing needs to be released then.
+ */
+int convert_py2jav(PyObject *pyobj, enum CVT_JType type, jclass javatype,
+        jvalue *javavalue);
+
+/**
+ * Releases a value obtained from convert_py2jav() or a convert_ArgFunc.
+ *
+ * Deletes the local reference to the objects that were created for the call,
+ * after copying arrays back into inout() buffers.
+ */
+void convert_py2jav_release(PyObject *pyobj, enum CVT_JType type,
+        jvalue *javavalue);
+
+
+/**
+ * Converts a Python object for a parameter of a known type.
+ *
+ * Returns 1 on success, or 0 with an exception set if the object can't be
+ * passed as that type.
+ */
+typedef int (*convert_ArgFunc)(PyObject *pyobj, jclass javatype,
+        jvalue *javavalue);
+
+/**
+ * Returns the function converting parameters of the given type.
+ *
+ * This is meant for callers that already know what method they are calling,
+ * to skip convert_check_py2jav(); only the minimal checks are made.
+ */
+convert_ArgFunc convert_argfunc(enum CVT_JType type);
+
+
+/**
+ * Converts an object obtained from Java, and deletes the local reference.
+ *
+ * String objects get converted to unicode, other objects get wrapped. Whether
+ * the object can be a String is known from its declared class (kind).
+ */
+PyObject *convert_jobject_result(jobject ret, enum JAVA_ResultKind kind);
+
+
+/**
+ * Whether the GIL is released while Java methods run, so that other Python
+ * threads can run meanwhile. On by default; _pyjava.release_gil() sets it.
+ */
+extern int convert_release_gil;
+
+/**
+ * Raises the pending Java exception as a Python exception, and clears it.
+ *
+ * The Python exception is Interrupted for a java.lang.InterruptedException,
+ * JavaException otherwise; its message is the toString() of the Java one.
+ *
+ * @return NULL, so that it can be returned directly.
+ */
+PyObject *convert_java_exception(void);
+
+/**
+ * Calls a Java method and converts its return value as a Python object.
+ *
+ * @param release_gil Whether the GIL is released during the call (the
+ * parameters are already converted, and the result is converted after the
+ * GIL is acquired again).
+ * If the method throws, the exception is raised with convert_java_exception().
+ */
+typedef PyObject *(*convert_CallFunc)(jobject self, jmethodID method,
+        jvalue *params, int release_gil);
+
+/**
+ * Returns the function calling a method with the given return type.
+ *
+ * convert_calljava() dispatches to these. For object return types, kind tells
+ * whether the result needs to be checked for String (see java_result_kind()).
+ */
+convert_CallFunc convert_callfunc(enum CVT_JType returntype,
+        enum JAVA_ResultKind kind);
+
+/**
+ * Returns the function calling a static method with the given return type.
+ *
+ * convert_calljava_static() dispatches to these; self is the class.
  */
-void convert_py2jav(PyObject *pyobj, jclass javatype, jvalue *javavalue);
+convert_CallFunc convert_callstaticfunc(enum CVT_JType returntype,
+        enum JAVA_ResultKind kind);
 
 
 /**
  * Convert the return value of a Java method as a Python object.
  *
- * This function takes the return type as a jclass; it can be an object or a
- * POD, and the correct Call<type>MethodA() function will be used.
+ * This function takes the return type as a type code (see java_id_type()); it
+ * can be an object or a POD, and the correct Call<type>MethodA() function
+ * will be used. The GIL is released during the call if convert_release_gil
+ * is set.
  */
 PyObject *convert_calljava(jobject self, jmethodID method,
-        jvalue *params, jclass returntype);
+        jvalue *params, enum CVT_JType returntype,
+        enum JAVA_ResultKind kind);
 
 
 /**
  * Convert the return value of a Java static method as a Python object.
  *
- * This function takes the return type as a jclass; it can be an object or a
- * POD, and the correct CallStatic<type>MethodA() function will be used.
+ * This function takes the return type as a type code (see java_id_type()); it
+ * can be an object or a POD, and the correct CallStatic<type>MethodA()
+ * function will be used. The GIL is released during the call if
+ * convert_release_gil is set.
  */
 PyObject *convert_calljava_static(jclass javaclass, jmethodID method,
-        jvalue *params, jclass returntype);
+        jvalue *params, enum CVT_JType returntype,
+        enum JAVA_ResultKind kind);
 
 
 /**
  * Convert the value of a Java field as a Python object.
  *
- * This function takes the class, the object (or NULL) and the name of the
- * field. It can return either an object or a POD, obtained using the correct
- * Get<type>Field() function.
+ * This function takes the class, the object (or NULL) and the field, as
+ * returned by java_get_field(). It can return either an object or a POD,
+ * obtained using the correct Get<type>Field() function.
  *
- * If there is no field by that name, returns NULL (doesn't set an exception).
+ * If field is NULL (there is no field by that name), returns NULL (doesn't set
+ * an exception).
  */
 PyObject *convert_getjavafield(jclass javaclass, jobject object,
-        const char *name, int type);
+        const java_Field *field, int type);
 
 
 /**
  * Sets a field on a Java class or instance to the given Python object.
  *
- * This function takes the class, the object (or NULL), the name of the field
- * and the Python object, and sets it using the correct Get<type>Field()
- * function.
+ * This function takes the class, the object (or NULL), the field (as returned
+ * by java_get_field()) and the Python object, and sets it using the correct
+ * Set<type>Field() function.
  *
- * If the field can be set, returns 1, if not 0, and if there is no field by
- * that name, returns -1.
+ * If the field can be set, returns 1, if not 0, and if field is NULL (there is
+ * no field by that name), returns -1. If the value couldn't be converted,
+ * returns -2 with an exception set.
  */
 int convert_setjavafield(jclass javaclass, jobject javaobject,
-        const char *name, int type, PyObject *value);
+        const java_Field *field, int type, PyObject *value);
+
+
+/**
+ * Shares the memory of a Python buffer with Java as a direct ByteBuffer.
+ *
+ * The buffer has to be writable and contiguous. It stays exported until the
+ * ByteBuffer gets collected by the JVM.
+ *
+ * @return A local reference to the ByteBuffer, or NULL with an exception set.
+ */
+jobject convert_share_buffer(PyObject *pyobj);
+
+
+/**
+ * Adds the statistics of this module to a dictionary.
+ *
+ * Used by _pyjava.stats().
+ */
+void convert_stats(PyObject *dict);
 
 #endif
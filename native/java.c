@@ -1,5 +1,6 @@
 #include "java.h"
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -7,14 +8,55 @@
 #include <windows.h>
 #else
 #include <dlfcn.h>
+#include <pthread.h>
 #endif
 
 
-JNIEnv *penv = NULL;
+JavaVM *java_vm = NULL;
+JAVA_THREAD_LOCAL JNIEnv *java_thread_env = NULL;
+unsigned long java_threads_attached = 0;
+
+static void java_free_frames(void);
+
+/* Its destructor (fiber-local storage callback on Windows) detaches the
+ * threads when they exit */
+#if defined(_WIN32) || defined(_WIN64)
+static DWORD thread_key = FLS_OUT_OF_INDEXES;
+
+static void WINAPI java_thread_exit(void *env)
+#else
+static pthread_key_t thread_key;
+
+static void java_thread_exit(void *env)
+#endif
+{
+    java_free_frames();
+    java_thread_env = NULL;
+    (*java_vm)->DetachCurrentThread(java_vm);
+}
+
+JNIEnv *java_attach_thread(void)
+{
+    JNIEnv *env;
+    if(java_vm == NULL)
+        return NULL;
+    if((*java_vm)->AttachCurrentThreadAsDaemon(
+            java_vm, (void**)&env, NULL) != JNI_OK)
+        return NULL;
+    java_thread_env = env;
+    java_threads_attached++;
+#if defined(_WIN32) || defined(_WIN64)
+    if(thread_key != FLS_OUT_OF_INDEXES)
+        FlsSetValue(thread_key, env);
+#else
+    pthread_setspecific(thread_key, env);
+#endif
+    return env;
+}
 
 typedef jint (JNICALL *type_JNI_CreateJavaVM)(JavaVM**, void**, JavaVMInitArgs*);
 
-JNIEnv *java_start_vm(const char *path, const char **opts, size_t nbopts)
+int java_start_vm(const char *path, const char **opts, size_t nbopts)
 {
     JavaVM *jvm = NULL;
     jint res;
@@ -34,14 +76,14 @@ JNIEnv *java_start_vm(const char *path, const char **opts, size_t nbopts)
             if(jvm_dll == NULL)
             {
                 free(options);
-                return NULL;
+                return 0;
             }
             dyn_JNI_CreateJavaVM = (type_JNI_CreateJavaVM)GetProcAddress(jvm_dll, "JNI_CreateJavaVM");
             if(dyn_JNI_CreateJavaVM == NULL)
             {
                 FreeLibrary(jvm_dll);
                 free(options);
-                return NULL;
+                return 0;
             }
         }
         #else
@@ -50,14 +92,14 @@ JNIEnv *java_start_vm(const char *path, const char **opts, size_t nbopts)
             if(jvm_dll == NULL)
             {
                 free(options);
-                return NULL;
+                return 0;
             }
             dyn_JNI_CreateJavaVM = dlsym(jvm_dll, "JNI_CreateJavaVM");
             if(dyn_JNI_CreateJavaVM == NULL)
             {
                 dlclose(jvm_dll);
                 free(options);
-                return NULL;
+                return 0;
             }
         }
         #endif
@@ -77,15 +119,29 @@ JNIEnv *java_start_vm(const char *path, const char **opts, size_t nbopts)
     #error "JNI 1.1 is not supported"
     #endif
 
-    return (res >= 0)?env:NULL;
+    if(res < 0)
+        return 0;
+
+    /* This thread was attached by JNI_CreateJavaVM() */
+    java_vm = jvm;
+    java_thread_env = env;
+#if defined(_WIN32) || defined(_WIN64)
+    thread_key = FlsAlloc(java_thread_exit);
+#else
+    pthread_key_create(&thread_key, java_thread_exit);
+#endif
+    return 1;
 }
 
 jstring str_utf8; /* "UTF-8" */
 
 /* java.lang.Class */
 jclass class_Class;
+    jmethodID meth_Class_getComponentType;
     jmethodID meth_Class_getConstructors;
     jmethodID meth_Class_getField;
+    jmethodID meth_Class_getFields;
+    jmethodID meth_Class_getInterfaces;
     jmethodID meth_Class_getMethods;
     jmethodID meth_Class_getName;
     jmethodID meth_Class_isPrimitive;
@@ -93,12 +149,27 @@ jclass class_Class;
 /* java.lang.Object */
 jclass class_Object;
     jmethodID meth_Object_equals;
+    jmethodID meth_Object_toString;
+
+/* java.lang.InterruptedException */
+jclass class_InterruptedException;
+
+/* java.lang.System */
+jclass class_System;
+    jmethodID meth_System_identityHashCode;
 
 /* java.lang.String */
 jclass class_String;
     jmethodID cstr_String_bytes;
     jmethodID meth_String_getBytes;
 
+/* java.nio.Buffer */
+jclass class_Buffer;
+    jmethodID meth_Buffer_isReadOnly;
+
+/* java.nio.ByteBuffer */
+jclass class_ByteBuffer;
+
 /* java.lang.reflect.Method */
     jmethodID meth_Method_getModifiers;
     jmethodID meth_Method_getName;
@@ -107,6 +178,7 @@ jclass class_String;
 
 /* java.lang.reflect.Field */
     jmethodID meth_Field_getModifiers;
+    jmethodID meth_Field_getName;
     jmethodID meth_Field_getType;
 
 /* java.lang.reflect.Constructor */
@@ -116,18 +188,56 @@ jclass class_String;
 jclass class_Modifier;
     jmethodID meth_Modifier_isStatic;
 
+/* The Class objects of the primitive types, e.g. Integer.TYPE */
+static jclass jptypes[NB_JPTYPES];
+static const char *jptypes_classes[NB_JPTYPES] = {
+    "java/lang/Void",
+    "java/lang/Boolean",
+    "java/lang/Byte",
+    "java/lang/Character",
+    "java/lang/Short",
+    "java/lang/Integer",
+    "java/lang/Long",
+    "java/lang/Float",
+    "java/lang/Double"
+};
+
+/**
+ * Finds a class and returns a global reference to it.
+ *
+ * The classes kept in globals are used from every thread, so they can't be
+ * local references.
+ */
+static jclass java_find_global_class(const char *name)
+{
+    jclass local = (*penv)->FindClass(penv, name);
+    jclass global = (*penv)->NewGlobalRef(penv, local);
+    (*penv)->DeleteLocalRef(penv, local);
+    return global;
+}
+
 void java_init(void)
 {
     jclass class_Method, class_Field, class_Constructor;
+    size_t i;
 
-    class_Class = (*penv)->FindClass(
-            penv, "java/lang/Class");
+    class_Class = java_find_global_class(
+            "java/lang/Class");
+    meth_Class_getComponentType = (*penv)->GetMethodID(
+            penv, class_Class, "getComponentType",
+            "()Ljava/lang/Class;");
     meth_Class_getConstructors = (*penv)->GetMethodID(
             penv, class_Class, "getConstructors",
             "()[Ljava/lang/reflect/Constructor;");
     meth_Class_getField = (*penv)->GetMethodID(
             penv, class_Class, "getField",
             "(Ljava/lang/String;)Ljava/lang/reflect/Field;");
+    meth_Class_getFields = (*penv)->GetMethodID(
+            penv, class_Class, "getFields",
+            "()[Ljava/lang/reflect/Field;");
+    meth_Class_getInterfaces = (*penv)->GetMethodID(
+            penv, class_Class, "getInterfaces",
+            "()[Ljava/lang/Class;");
     meth_Class_getMethods = (*penv)->GetMethodID(
             penv, class_Class, "getMethods",
             "()[Ljava/lang/reflect/Method;");
@@ -138,14 +248,26 @@ void java_init(void)
             penv, class_Class, "isPrimitive",
             "()Z");
 
-    class_Object = (*penv)->FindClass(
-            penv, "java/lang/Object");
+    class_Object = java_find_global_class(
+            "java/lang/Object");
     meth_Object_equals = (*penv)->GetMethodID(
             penv, class_Object, "equals",
             "(Ljava/lang/Object;)Z");
+    meth_Object_toString = (*penv)->GetMethodID(
+            penv, class_Object, "toString",
+            "()Ljava/lang/String;");
 
-    class_String = (*penv)->FindClass(
-            penv, "java/lang/String");
+    class_InterruptedException = java_find_global_class(
+            "java/lang/InterruptedException");
+
+    class_System = java_find_global_class(
+            "java/lang/System");
+    meth_System_identityHashCode = (*penv)->GetStaticMethodID(
+            penv, class_System, "identityHashCode",
+            "(Ljava/lang/Object;)I");
+
+    class_String = java_find_global_class(
+            "java/lang/String");
     cstr_String_bytes = (*penv)->GetMethodID(
             penv, class_String, "<init>",
             "([BLjava/lang/String;)V");
@@ -153,6 +275,15 @@ void java_init(void)
             penv, class_String, "getBytes",
             "(Ljava/lang/String;)[B");
 
+    class_Buffer = java_find_global_class(
+            "java/nio/Buffer");
+    meth_Buffer_isReadOnly = (*penv)->GetMethodID(
+            penv, class_Buffer, "isReadOnly",
+            "()Z");
+
+    class_ByteBuffer = java_find_global_class(
+            "java/nio/ByteBuffer");
+
     class_Method = (*penv)->FindClass(
             penv, "java/lang/reflect/Method");
     meth_Method_getModifiers = (*penv)->GetMethodID(
@@ -173,6 +304,9 @@ void java_init(void)
     meth_Field_getModifiers = (*penv)->GetMethodID(
             penv, class_Field, "getModifiers",
             "()I");
+    meth_Field_getName = (*penv)->GetMethodID(
+            penv, class_Field, "getName",
+            "()Ljava/lang/String;");
     meth_Field_getType = (*penv)->GetMethodID(
             penv, class_Field, "getType",
             "()Ljava/lang/Class;");
@@ -183,45 +317,156 @@ void java_init(void)
             penv, class_Constructor, "getParameterTypes",
             "()[Ljava/lang/Class;");
 
-    class_Modifier = (*penv)->FindClass(
-            penv, "java/lang/reflect/Modifier");
+    class_Modifier = java_find_global_class(
+            "java/lang/reflect/Modifier");
     meth_Modifier_isStatic = (*penv)->GetStaticMethodID(
             penv, class_Modifier, "isStatic",
             "(I)Z");
 
-    str_utf8 = (*penv)->NewStringUTF(penv, "UTF-8");
+    {
+        jstring str = (*penv)->NewStringUTF(penv, "UTF-8");
+        str_utf8 = (*penv)->NewGlobalRef(penv, str);
+        (*penv)->DeleteLocalRef(penv, str);
+    }
+
+    for(i = 0; i < NB_JPTYPES; ++i)
+    {
+        jclass clasz = (*penv)->FindClass(penv, jptypes_classes[i]);
+        jfieldID field = (*penv)->GetStaticFieldID(
+                penv, clasz, "TYPE", "Ljava/lang/Class;");
+        jclass type = (*penv)->GetStaticObjectField(penv, clasz, field);
+        jptypes[i] = (*penv)->NewGlobalRef(penv, type);
+        (*penv)->DeleteLocalRef(penv, type);
+        (*penv)->DeleteLocalRef(penv, clasz);
+    }
+}
+
+java_FrameStats java_frame_stats = {0, 0, 0};
+
+/* The frames currently pushed */
+typedef struct _S_Frame {
+    jint capacity;
+    char flat;
+    char pushed; /* 0 inside a flat frame, see java_push_flat_frame() */
+} Frame;
+
+/* Frames are per thread, like the references in them */
+static JAVA_THREAD_LOCAL Frame *frame_stack = NULL;
+static JAVA_THREAD_LOCAL size_t frame_stack_size = 0;
+static JAVA_THREAD_LOCAL size_t frame_depth = 0;
+static JAVA_THREAD_LOCAL size_t flat_depth = 0; /* flat frames among them */
+static JAVA_THREAD_LOCAL unsigned long frame_refs = 0;
+
+static void java_free_frames(void)
+{
+    free(frame_stack);
+    frame_stack = NULL;
+    frame_stack_size = 0;
+}
+
+static int _java_push_frame(jint capacity, char flat)
+{
+    if(frame_depth == frame_stack_size)
+    {
+        size_t size = (frame_stack_size == 0)?16:(2 * frame_stack_size);
+        Frame *stack = realloc(frame_stack, sizeof(Frame) * size);
+        if(stack == NULL)
+            return 0;
+        frame_stack = stack;
+        frame_stack_size = size;
+    }
+
+    /* Inside a flat frame, references go to that frame */
+    if(flat_depth > 0 && !flat)
+    {
+        frame_stack[frame_depth].capacity = 0;
+        frame_stack[frame_depth].flat = 0;
+        frame_stack[frame_depth++].pushed = 0;
+        return 1;
+    }
+
+    if((*penv)->PushLocalFrame(penv, capacity) < 0)
+    {
+        (*penv)->ExceptionClear(penv); /* OutOfMemoryError */
+        return 0;
+    }
+
+    frame_stack[frame_depth].capacity = capacity;
+    frame_stack[frame_depth].flat = flat;
+    frame_stack[frame_depth++].pushed = 1;
+    frame_refs += capacity;
+    if(flat)
+        flat_depth++;
+
+    java_frame_stats.frames++;
+    if(frame_depth > java_frame_stats.depth_peak)
+        java_frame_stats.depth_peak = frame_depth;
+    if(frame_refs > java_frame_stats.refs_peak)
+        java_frame_stats.refs_peak = frame_refs;
+    return 1;
+}
+
+int java_push_frame(jint capacity)
+{
+    return _java_push_frame(capacity, 0);
+}
+
+int java_push_flat_frame(jint capacity)
+{
+    return _java_push_frame(capacity, 1);
+}
+
+jobject java_pop_frame(jobject result)
+{
+    Frame *frame;
+    assert(frame_depth > 0);
+    frame = &frame_stack[--frame_depth];
+    if(!frame->pushed)
+        return result;
+    if(frame->flat)
+        flat_depth--;
+    frame_refs -= frame->capacity;
+    return (*penv)->PopLocalFrame(penv, result);
+}
+
+int java_in_flat_frame(void)
+{
+    return flat_depth > 0;
 }
 
+/**
+ * Builds the list of overloads with the given name from an array of
+ * reflected methods or constructors.
+ *
+ * @param names The names of the methods in the array, if they are already
+ * known; if NULL, getName() is called on each method.
+ */
 static java_Methods *_java_list_overloads(jclass javaclass,
+        jarray method_array, char **names,
         const char *methodname, int constructors, int what)
 {
-    jarray method_array;
     size_t nb_methods;
     size_t nb_args;
     size_t i;
     java_Methods *methods;
 
-    if(!constructors)
-    {
-        /* Method[] method_array = javaclass.getMethods() */
-        method_array = (*penv)->CallObjectMethod(
-                penv,
-                javaclass, meth_Class_getMethods);
-    }
-    else
-    {
-        /* Constructor[] method_array = javaclass.getConstructors() */
-        method_array = (*penv)->CallObjectMethod(
-                penv,
-                javaclass, meth_Class_getConstructors);
-    }
     nb_methods = (*penv)->GetArrayLength(penv, method_array);
+    if(nb_methods == 0)
+        return NULL;
 
     /* Create the list of methods. */
     /* FIXME : we could count the exact number of methods we'll need to store,
      * instead of using the total array length as an upper bound. */
     methods = malloc(sizeof(java_Methods) +
                      sizeof(java_Method) * (nb_methods - 1));
+    methods->refcount = 1;
+    methods->what = 0;
+    for(i = 0; i < JAVA_CALLCACHE_SIZE; ++i)
+    {
+        methods->callcache[i].key = NULL;
+        methods->callcache[i].method = NULL;
+    }
+    methods->callcache_next = 0;
     methods->nb_methods = 0;
 
     for(i = 0; i < nb_methods; ++i)
@@ -237,7 +482,15 @@ static java_Methods *_java_list_overloads(jclass javaclass,
                 penv,
                 method_array, i);
 
-        if(!constructors)
+        if(names != NULL)
+        {
+            if(strcmp(names[i], methodname) != 0)
+            {
+                (*penv)->DeleteLocalRef(penv, method);
+                continue;
+            }
+        }
+        else if(!constructors)
         {
             /* String name = method.getName() */
             jobject oname = (*penv)->CallObjectMethod(
@@ -247,8 +500,12 @@ static java_Methods *_java_list_overloads(jclass javaclass,
                     penv, oname, NULL);
             char correctname = strcmp(name, methodname) == 0;
             (*penv)->ReleaseStringUTFChars(penv, oname, name);
+            (*penv)->DeleteLocalRef(penv, oname);
             if(!correctname)
+            {
+                (*penv)->DeleteLocalRef(penv, method);
                 continue;
+            }
         }
 
         if(!constructors)
@@ -268,7 +525,10 @@ static java_Methods *_java_list_overloads(jclass javaclass,
 
         if( (is_static && !(what & FIELD_STATIC))
          || (!is_static && !(what & FIELD_NONSTATIC)) )
+        {
+            (*penv)->DeleteLocalRef(penv, method);
             continue;
+        }
 
         /* Class[] parameter_types = method.getParameterTypes() */
         if(!constructors)
@@ -293,33 +553,48 @@ static java_Methods *_java_list_overloads(jclass javaclass,
                 penv, method);
         m->is_static = is_static;
 
-        /* Store the parameters */
+        /* Store the parameters; the list can outlive the current call, so we
+         * keep global references to the classes */
         m->nb_args = py_nb_args;
         m->args = malloc(sizeof(jclass) * py_nb_args);
-        if(is_static) /* also if constructors */
+        m->argtypes = malloc(sizeof(enum CVT_JType) * py_nb_args);
+        if(!is_static)
         {
-            for(j = 0; j < nb_args; ++j)
-                m->args[j] = (*penv)->GetObjectArrayElement(
-                        penv,
-                        parameter_types, j);
+            m->args[0] = (*penv)->NewGlobalRef(penv, javaclass);
+            m->argtypes[0] = CVT_J_OBJECT;
         }
-        else
+        for(j = 0; j < nb_args; ++j)
         {
-            m->args[0] = javaclass;
-            for(j = 0; j < nb_args; ++j)
-                m->args[j+1] = (*penv)->GetObjectArrayElement(
-                        penv,
-                        parameter_types, j);
+            size_t a = j + py_nb_args - nb_args;
+            jclass param = (*penv)->GetObjectArrayElement(
+                    penv,
+                    parameter_types, j);
+            m->args[a] = (*penv)->NewGlobalRef(penv, param);
+            m->argtypes[a] = java_id_type(param);
+            (*penv)->DeleteLocalRef(penv, param);
         }
+        (*penv)->DeleteLocalRef(penv, parameter_types);
 
         /* Store the return type */
         if(!constructors)
         {
-            m->returntype = (*penv)->CallObjectMethod(
+            jclass returntype = (*penv)->CallObjectMethod(
                     penv,
                     method, meth_Method_getReturnType);
+            m->returntype = (*penv)->NewGlobalRef(penv, returntype);
+            m->rettype = java_id_type(returntype);
+            m->retkind = java_result_kind(returntype);
+            (*penv)->DeleteLocalRef(penv, returntype);
         }
+        else
+        {
+            m->returntype = NULL;
+            m->rettype = CVT_J_VOID;
+            m->retkind = JAVA_RESULT_WRAP;
+        }
+        (*penv)->DeleteLocalRef(penv, method);
 
+        methods->what |= is_static?FIELD_STATIC:FIELD_NONSTATIC;
         methods->nb_methods++;
     }
 
@@ -335,27 +610,414 @@ static java_Methods *_java_list_overloads(jclass javaclass,
 java_Methods *java_list_methods(jclass javaclass,
         const char *methodname, int what)
 {
-    return _java_list_overloads(javaclass, methodname, 0, what);
+    java_Methods *methods;
+
+    /* Method[] method_array = javaclass.getMethods() */
+    jarray method_array = (*penv)->CallObjectMethod(
+            penv,
+            javaclass, meth_Class_getMethods);
+
+    methods = _java_list_overloads(javaclass, method_array, NULL,
+                                   methodname, 0, what);
+    (*penv)->DeleteLocalRef(penv, method_array);
+    return methods;
+}
+
+size_t java_list_all_methods(jclass javaclass,
+        char ***names, java_Methods ***lists)
+{
+    size_t nb_methods;
+    size_t nb_names = 0;
+    size_t i;
+    char **method_names;
+
+    /* Method[] method_array = javaclass.getMethods() */
+    jarray method_array = (*penv)->CallObjectMethod(
+            penv,
+            javaclass, meth_Class_getMethods);
+    nb_methods = (*penv)->GetArrayLength(penv, method_array);
+
+    /* Get all the names once, so that grouping the overloads doesn't need
+     * to go through Java again */
+    method_names = malloc(sizeof(char*) * (nb_methods + 1));
+    *names = malloc(sizeof(char*) * (nb_methods + 1));
+    for(i = 0; i < nb_methods; ++i)
+    {
+        size_t j;
+        jobject method = (*penv)->GetObjectArrayElement(
+                penv,
+                method_array, i);
+        /* String name = method.getName() */
+        jobject oname = (*penv)->CallObjectMethod(
+                penv,
+                method, meth_Method_getName);
+        const char *name = (*penv)->GetStringUTFChars(
+                penv, oname, NULL);
+        method_names[i] = malloc(strlen(name) + 1);
+        strcpy(method_names[i], name);
+        (*penv)->ReleaseStringUTFChars(penv, oname, name);
+        (*penv)->DeleteLocalRef(penv, oname);
+        (*penv)->DeleteLocalRef(penv, method);
+
+        for(j = 0; j < nb_names; ++j)
+            if(strcmp((*names)[j], method_names[i]) == 0)
+                break;
+        if(j == nb_names)
+            (*names)[nb_names++] = method_names[i];
+    }
+
+    *lists = malloc(sizeof(java_Methods*) * (nb_names + 1));
+    for(i = 0; i < nb_names; ++i)
+        (*lists)[i] = _java_list_overloads(javaclass, method_array,
+                                           method_names, (*names)[i],
+                                           0, FIELD_BOTH);
+
+    /* Hand the distinct names over to the caller and free the others */
+    for(i = 0; i < nb_methods; ++i)
+    {
+        size_t j;
+        for(j = 0; j < nb_names; ++j)
+            if((*names)[j] == method_names[i])
+                break;
+        if(j == nb_names)
+            free(method_names[i]);
+    }
+    free(method_names);
+    (*penv)->DeleteLocalRef(penv, method_array);
+
+    return nb_names;
 }
 
 java_Methods *java_list_constructors(jclass javaclass)
 {
-    return _java_list_overloads(javaclass, "<init>", 1, FIELD_STATIC);
+    java_Methods *methods;
+
+    /* Constructor[] method_array = javaclass.getConstructors() */
+    jarray method_array = (*penv)->CallObjectMethod(
+            penv,
+            javaclass, meth_Class_getConstructors);
+
+    methods = _java_list_overloads(javaclass, method_array, NULL,
+                                   "<init>", 1, FIELD_STATIC);
+    (*penv)->DeleteLocalRef(penv, method_array);
+    return methods;
+}
+
+void java_incref_methods(java_Methods *methods)
+{
+    methods->refcount++;
 }
 
-void java_free_methods(java_Methods *methods)
+static void java_clear_method(java_Method *m)
+{
+    size_t j;
+    for(j = 0; j < m->nb_args; ++j)
+        (*penv)->DeleteGlobalRef(penv, m->args[j]);
+    free(m->args);
+    free(m->argtypes);
+    if(m->returntype != NULL)
+        (*penv)->DeleteGlobalRef(penv, m->returntype);
+}
+
+void java_decref_methods(java_Methods *methods)
 {
     size_t i;
+    if(--methods->refcount > 0)
+        return ;
     for(i = 0; i < methods->nb_methods; ++i)
-        free(methods->methods[i].args);
+        java_clear_method(&methods->methods[i]);
+    for(i = 0; i < JAVA_CALLCACHE_SIZE; ++i)
+        free(methods->callcache[i].key);
     free(methods);
 }
 
+/**
+ * Parses a type from a JNI signature.
+ *
+ * @param javatype Where to store a global reference to the class.
+ * @returns A pointer to what follows the type in the signature, or NULL if it
+ * can't be parsed or the class can't be found.
+ */
+static const char *java_parse_type(const char *sig,
+        enum CVT_JType *type, jclass *javatype)
+{
+    const char *end;
+    const char *classname;
+    size_t len;
+    static const char primitives[NB_JPTYPES + 1] = "VZBCSIJFD";
+    const char *primitive = (*sig != '\0')?strchr(primitives, *sig):NULL;
+
+    if(primitive != NULL)
+    {
+        *type = primitive - primitives;
+        *javatype = (*penv)->NewGlobalRef(penv, jptypes[*type]);
+        return sig + 1;
+    }
+
+    /* Objects are "Ljava/lang/String;", which FindClass() wants as
+     * "java/lang/String", arrays are "[I" or "[Ljava/lang/String;", which
+     * FindClass() takes as-is */
+    end = sig;
+    while(*end == '[')
+        end++;
+    if(*end == 'L')
+    {
+        end = strchr(end, ';');
+        if(end == NULL)
+            return NULL;
+    }
+    else if(end == sig || *end == '\0' || strchr(primitives + 1, *end) == NULL)
+        return NULL;
+    end++;
+
+    if(*sig == 'L')
+    {
+        classname = sig + 1;
+        len = end - sig - 2;
+    }
+    else
+    {
+        classname = sig;
+        len = end - sig;
+    }
+
+    {
+        jclass found;
+        char *name = malloc(len + 1);
+        memcpy(name, classname, len);
+        name[len] = '\0';
+        found = (*penv)->FindClass(penv, name);
+        free(name);
+        if(found == NULL)
+        {
+            (*penv)->ExceptionClear(penv);
+            return NULL;
+        }
+        *type = CVT_J_OBJECT;
+        *javatype = (*penv)->NewGlobalRef(penv, found);
+        (*penv)->DeleteLocalRef(penv, found);
+    }
+
+    return end;
+}
+
+java_Method *java_get_method(jclass javaclass, const char *name,
+        const char *signature)
+{
+    java_Method *m;
+    const char *sig;
+    jmethodID id;
+    char is_static = 0;
+    size_t maxargs = strlen(signature) + 1;
+
+    if(signature[0] != '(')
+        return NULL;
+
+    id = (*penv)->GetMethodID(penv, javaclass, name, signature);
+    if(id == NULL)
+    {
+        (*penv)->ExceptionClear(penv);
+        id = (*penv)->GetStaticMethodID(penv, javaclass, name, signature);
+        if(id == NULL)
+        {
+            (*penv)->ExceptionClear(penv);
+            return NULL;
+        }
+        is_static = 1;
+    }
+
+    m = malloc(sizeof(java_Method));
+    m->id = id;
+    m->is_static = is_static;
+    m->nb_args = 0;
+    m->args = malloc(sizeof(jclass) * maxargs);
+    m->argtypes = malloc(sizeof(enum CVT_JType) * maxargs);
+    m->returntype = NULL;
+
+    /* Like in _java_list_overloads(), non-static methods take "self" first */
+    if(!is_static)
+    {
+        m->args[0] = (*penv)->NewGlobalRef(penv, javaclass);
+        m->argtypes[0] = CVT_J_OBJECT;
+        m->nb_args = 1;
+    }
+
+    sig = signature + 1;
+    while(*sig != ')')
+    {
+        sig = java_parse_type(sig,
+                              &m->argtypes[m->nb_args],
+                              &m->args[m->nb_args]);
+        if(sig == NULL || m->argtypes[m->nb_args] == CVT_J_VOID)
+        {
+            if(sig != NULL)
+                m->nb_args++;
+            java_free_method(m);
+            return NULL;
+        }
+        m->nb_args++;
+    }
+
+    sig = java_parse_type(sig + 1, &m->rettype, &m->returntype);
+    if(sig == NULL || *sig != '\0')
+    {
+        java_free_method(m);
+        return NULL;
+    }
+    m->retkind = java_result_kind(m->returntype);
+
+    return m;
+}
+
+void java_free_method(java_Method *method)
+{
+    java_clear_method(method);
+    free(method);
+}
+
+java_Field *java_get_field(jclass javaclass, const char *name)
+{
+    jobject javafield;
+    jclass javatype;
+    jint modifiers;
+    java_Field *field;
+    jstring javaname = java_from_utf8(name, strlen(name));
+
+    /* Field javafield = javaclass.getField(javaname) */
+    javafield = (*penv)->CallObjectMethod(
+            penv,
+            javaclass,
+            meth_Class_getField,
+            javaname);
+    (*penv)->DeleteLocalRef(penv, javaname);
+
+    if(javafield == NULL)
+    {
+        (*penv)->ExceptionClear(penv);
+        return NULL; /* no field with that name */
+    }
+
+    field = malloc(sizeof(java_Field));
+    field->id = (*penv)->FromReflectedField(penv, javafield);
+
+    modifiers = (*penv)->CallIntMethod(
+            penv,
+            javafield, meth_Field_getModifiers);
+    field->is_static = (*penv)->CallStaticBooleanMethod(
+            penv,
+            class_Modifier, meth_Modifier_isStatic,
+            modifiers) != JNI_FALSE;
+
+    javatype = (*penv)->CallObjectMethod(
+            penv,
+            javafield,
+            meth_Field_getType);
+    field->type = java_id_type(javatype);
+    field->javatype = (*penv)->NewGlobalRef(penv, javatype);
+    field->kind = java_result_kind(javatype);
+
+    (*penv)->DeleteLocalRef(penv, javatype);
+    (*penv)->DeleteLocalRef(penv, javafield);
+
+    return field;
+}
+
+void java_free_field(java_Field *field)
+{
+    (*penv)->DeleteGlobalRef(penv, field->javatype);
+    free(field);
+}
+
+size_t java_list_field_names(jclass javaclass, char ***names)
+{
+    size_t nb_fields;
+    size_t nb_names = 0;
+    size_t i;
+
+    /* Field[] field_array = javaclass.getFields() */
+    jarray field_array = (*penv)->CallObjectMethod(
+            penv,
+            javaclass, meth_Class_getFields);
+    nb_fields = (*penv)->GetArrayLength(penv, field_array);
+
+    *names = malloc(sizeof(char*) * (nb_fields + 1));
+    for(i = 0; i < nb_fields; ++i)
+    {
+        size_t j;
+        jobject field = (*penv)->GetObjectArrayElement(
+                penv,
+                field_array, i);
+        /* String name = field.getName() */
+        jobject oname = (*penv)->CallObjectMethod(
+                penv,
+                field, meth_Field_getName);
+        const char *name = (*penv)->GetStringUTFChars(
+                penv, oname, NULL);
+
+        /* A field can hide another with the same name */
+        for(j = 0; j < nb_names; ++j)
+            if(strcmp((*names)[j], name) == 0)
+                break;
+        if(j == nb_names)
+        {
+            (*names)[nb_names] = malloc(strlen(name) + 1);
+            strcpy((*names)[nb_names], name);
+            nb_names++;
+        }
+
+        (*penv)->ReleaseStringUTFChars(penv, oname, name);
+        (*penv)->DeleteLocalRef(penv, oname);
+        (*penv)->DeleteLocalRef(penv, field);
+    }
+    (*penv)->DeleteLocalRef(penv, field_array);
+
+    return nb_names;
+}
+
+enum CVT_JType java_id_type(jclass javatype)
+{
+    char primitive = (*penv)->CallBooleanMethod(
+            penv,
+            javatype, meth_Class_isPrimitive) == JNI_TRUE;
+
+    if(primitive)
+    {
+        size_t i;
+        for(i = 0; i < NB_JPTYPES; ++i)
+        {
+            if((*penv)->IsSameObject(penv, javatype, jptypes[i]))
+                return i;
+        }
+        assert(0); /* can't happen */
+        return 0;
+    }
+    else
+        return CVT_J_OBJECT;
+}
+
+enum JAVA_ResultKind java_result_kind(jclass javatype)
+{
+    if((*penv)->IsSameObject(penv, javatype, class_String))
+        return JAVA_RESULT_STRING;
+    else if((*penv)->IsAssignableFrom(penv, class_String, javatype))
+        return JAVA_RESULT_CHECK;
+    else
+        return JAVA_RESULT_WRAP;
+}
+
 jclass java_getclass(jobject javaobject)
 {
     return (*penv)->GetObjectClass(penv, javaobject);
 }
 
+jint java_identity_hash(jobject javaobject)
+{
+    return (*penv)->CallStaticIntMethod(
+            penv,
+            class_System, meth_System_identityHashCode,
+            javaobject);
+}
+
 int java_equals(jobject a, jobject b)
 {
     return (*penv)->CallBooleanMethod(penv, a, meth_Object_equals, b) != JNI_FALSE;
@@ -366,6 +1028,191 @@ int java_is_subclass(jclass sub, jclass klass)
     return (*penv)->IsAssignableFrom(penv, sub, klass) != JNI_FALSE;
 }
 
+jclass java_get_superclass(jclass javaclass)
+{
+    return (*penv)->GetSuperclass(penv, javaclass);
+}
+
+jobjectArray java_get_interfaces(jclass javaclass)
+{
+    /* Class[] interfaces = javaclass.getInterfaces() */
+    return (*penv)->CallObjectMethod(
+            penv,
+            javaclass, meth_Class_getInterfaces);
+}
+
+jclass java_get_component_type(jclass javaclass)
+{
+    /* Class component = javaclass.getComponentType() */
+    return (*penv)->CallObjectMethod(
+            penv,
+            javaclass, meth_Class_getComponentType);
+}
+
+void *java_get_array_elements(jarray array, enum CVT_JType type)
+{
+    void *elements = NULL;
+    switch(type)
+    {
+    case CVT_J_BOOLEAN:
+        elements = (*penv)->GetBooleanArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_BYTE:
+        elements = (*penv)->GetByteArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_CHAR:
+        elements = (*penv)->GetCharArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_SHORT:
+        elements = (*penv)->GetShortArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_INT:
+        elements = (*penv)->GetIntArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_LONG:
+        elements = (*penv)->GetLongArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_FLOAT:
+        elements = (*penv)->GetFloatArrayElements(penv, array, NULL);
+        break;
+    case CVT_J_DOUBLE:
+        elements = (*penv)->GetDoubleArrayElements(penv, array, NULL);
+        break;
+    default:
+        assert(0); /* not a primitive array */
+        break;
+    }
+    /* OutOfMemoryError */
+    if(elements == NULL)
+        (*penv)->ExceptionClear(penv);
+    return elements;
+}
+
+void java_release_array_elements(jarray array, enum CVT_JType type,
+        void *elements, jint mode)
+{
+    switch(type)
+    {
+    case CVT_J_BOOLEAN:
+        (*penv)->ReleaseBooleanArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_BYTE:
+        (*penv)->ReleaseByteArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_CHAR:
+        (*penv)->ReleaseCharArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_SHORT:
+        (*penv)->ReleaseShortArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_INT:
+        (*penv)->ReleaseIntArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_LONG:
+        (*penv)->ReleaseLongArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_FLOAT:
+        (*penv)->ReleaseFloatArrayElements(penv, array, elements, mode);
+        break;
+    case CVT_J_DOUBLE:
+        (*penv)->ReleaseDoubleArrayElements(penv, array, elements, mode);
+        break;
+    default:
+        assert(0); /* not a primitive array */
+        break;
+    }
+}
+
+size_t java_primitive_size(enum CVT_JType type)
+{
+    switch(type)
+    {
+    case CVT_J_BOOLEAN: return sizeof(jboolean);
+    case CVT_J_BYTE: return sizeof(jbyte);
+    case CVT_J_CHAR: return sizeof(jchar);
+    case CVT_J_SHORT: return sizeof(jshort);
+    case CVT_J_INT: return sizeof(jint);
+    case CVT_J_LONG: return sizeof(jlong);
+    case CVT_J_FLOAT: return sizeof(jfloat);
+    case CVT_J_DOUBLE: return sizeof(jdouble);
+    default: return 0;
+    }
+}
+
+jarray java_new_array(enum CVT_JType type, jsize length)
+{
+    jarray array = NULL;
+    switch(type)
+    {
+    case CVT_J_BOOLEAN:
+        array = (*penv)->NewBooleanArray(penv, length);
+        break;
+    case CVT_J_BYTE:
+        array = (*penv)->NewByteArray(penv, length);
+        break;
+    case CVT_J_CHAR:
+        array = (*penv)->NewCharArray(penv, length);
+        break;
+    case CVT_J_SHORT:
+        array = (*penv)->NewShortArray(penv, length);
+        break;
+    case CVT_J_INT:
+        array = (*penv)->NewIntArray(penv, length);
+        break;
+    case CVT_J_LONG:
+        array = (*penv)->NewLongArray(penv, length);
+        break;
+    case CVT_J_FLOAT:
+        array = (*penv)->NewFloatArray(penv, length);
+        break;
+    case CVT_J_DOUBLE:
+        array = (*penv)->NewDoubleArray(penv, length);
+        break;
+    default:
+        assert(0); /* not a primitive type */
+        break;
+    }
+    /* OutOfMemoryError */
+    if(array == NULL)
+        (*penv)->ExceptionClear(penv);
+    return array;
+}
+
+void java_set_array_region(jarray array, enum CVT_JType type,
+        jsize start, jsize length, const void *buf)
+{
+    switch(type)
+    {
+    case CVT_J_BOOLEAN:
+        (*penv)->SetBooleanArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_BYTE:
+        (*penv)->SetByteArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_CHAR:
+        (*penv)->SetCharArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_SHORT:
+        (*penv)->SetShortArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_INT:
+        (*penv)->SetIntArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_LONG:
+        (*penv)->SetLongArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_FLOAT:
+        (*penv)->SetFloatArrayRegion(penv, array, start, length, buf);
+        break;
+    case CVT_J_DOUBLE:
+        (*penv)->SetDoubleArrayRegion(penv, array, start, length, buf);
+        break;
+    default:
+        assert(0); /* not a primitive type */
+        break;
+    }
+}
+
 const char *java_getclassname(jclass javaclass, size_t *size)
 {
     const char *utf8;
@@ -380,10 +1227,35 @@ const char *java_getclassname(jclass javaclass, size_t *size)
 
 jstring java_from_utf8(const char *utf8, size_t size)
 {
+    jstring str;
+    jobject bytes;
+
+    /* ASCII is widened directly to UTF-16 */
+    {
+        jchar stack_buf[256];
+        jchar *buf = stack_buf;
+        size_t i;
+        if(size > 256)
+            buf = malloc(sizeof(jchar) * size);
+        /* Without memory for the copy, go through new String() below */
+        for(i = 0; buf != NULL && i < size; ++i)
+        {
+            unsigned char c = utf8[i];
+            if(c >= 0x80)
+                break;
+            buf[i] = c;
+        }
+        if(i == size)
+            str = (*penv)->NewString(penv, buf, size);
+        if(buf != stack_buf)
+            free(buf);
+        if(i == size)
+            return str;
+    }
+
     /* string = new String(utf8, "UTF-8"); */
 
-    jstring str;
-    jobject bytes = (*penv)->NewByteArray(penv, size);
+    bytes = (*penv)->NewByteArray(penv, size);
 
     (*penv)->SetByteArrayRegion(
             penv, bytes,
@@ -401,14 +1273,31 @@ jstring java_from_utf8(const char *utf8, size_t size)
 
 char *java_to_utf8(jstring str, size_t *newsize)
 {
+    jobject bytes;
+    size_t len;
+    char *utf8;
+
+    /* If the modified UTF-8 form is as long as the string, it is ASCII
+     * (a zero would take two bytes), which is the same in standard UTF-8 */
+    len = (*penv)->GetStringLength(penv, str);
+    if((*penv)->GetStringUTFLength(penv, str) == (jsize)len)
+    {
+        utf8 = malloc(len + 1);
+        (*penv)->GetStringUTFRegion(penv, str, 0, len, utf8);
+        utf8[len] = '\0';
+        if(newsize != NULL)
+            *newsize = len;
+        return utf8;
+    }
+
     /* byte[] utf8 = string.getBytes("UTF-8"); */
 
-    jobject bytes = (*penv)->CallObjectMethod(
+    bytes = (*penv)->CallObjectMethod(
             penv, str, meth_String_getBytes,
             str_utf8);
 
-    size_t len = (*penv)->GetArrayLength(penv, bytes);
-    char *utf8 = malloc(len + 1);
+    len = (*penv)->GetArrayLength(penv, bytes);
+    utf8 = malloc(len + 1);
     (*penv)->GetByteArrayRegion(penv, bytes, 0, len, (jbyte*)utf8);
 
     /* Clear reference */
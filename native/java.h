@@ -4,7 +4,46 @@
 #include <jni.h>
 
 
-extern JNIEnv *penv;
+#if defined(_MSC_VER)
+#define JAVA_THREAD_LOCAL __declspec(thread)
+#else
+#define JAVA_THREAD_LOCAL __thread
+#endif
+
+
+/**
+ * The JVM, or NULL if it hasn't been started.
+ */
+extern JavaVM *java_vm;
+
+/**
+ * The JNI environment of the current thread, or NULL if it hasn't been
+ * attached yet. Use penv instead.
+ */
+extern JAVA_THREAD_LOCAL JNIEnv *java_thread_env;
+
+/**
+ * Attaches the current thread to the JVM, as a daemon thread.
+ *
+ * The thread is detached when it exits, through a pthread key destructor or,
+ * on Windows, a fiber-local storage callback.
+ *
+ * @return The JNI environment of the thread, or NULL if the JVM isn't running
+ * or refused to attach it.
+ */
+JNIEnv *java_attach_thread(void);
+
+/**
+ * The JNI environment of the current thread, attaching it on first use.
+ *
+ * A JNIEnv is only valid on its own thread, so it can't be kept in a global.
+ */
+#define penv (java_thread_env != NULL?java_thread_env:java_attach_thread())
+
+/**
+ * Number of threads that were attached by java_attach_thread().
+ */
+extern unsigned long java_threads_attached;
 
 /**
  * Starts a JVM using the invocation API.
@@ -14,8 +53,88 @@ extern JNIEnv *penv;
  * @param path Path to the JVM DLL, to be passed to JNI_CreateJavaVM().
  * @param options The option strings to pass to the JVM.
  * @param nbopts The number of option strings to be passed.
+ * @return 1 on success; the current thread is then attached.
+ */
+int java_start_vm(const char *path, const char **opts, size_t nbopts);
+
+
+/**
+ * Pushes a frame for local references, with PushLocalFrame().
+ *
+ * Since Python never returns to Java, the local references created by JNI
+ * calls would otherwise never be freed; each entry point from Python (method
+ * call, attribute access...) runs in its own frame.
+ *
+ * @param capacity The number of local references the frame should be able to
+ * hold.
+ * @return 1 on success, 0 if the JVM is out of memory.
+ */
+int java_push_frame(jint capacity);
+
+/**
+ * Pushes a flat frame: until it is popped, java_push_frame() doesn't push
+ * anything and the local references created stay in this frame.
+ *
+ * Used by scopes that keep their objects as local references, which have to
+ * outlive the calls that created them.
+ */
+int java_push_flat_frame(jint capacity);
+
+/**
+ * Indicates whether a flat frame is currently pushed.
+ */
+int java_in_flat_frame(void);
+
+/**
+ * Pops the last frame pushed by java_push_frame() or java_push_flat_frame(),
+ * freeing its references.
+ *
+ * @param result A reference to keep, which is returned as a new local
+ * reference in the previous frame; can be NULL.
  */
-JNIEnv *java_start_vm(const char *path, const char **opts, size_t nbopts);
+jobject java_pop_frame(jobject result);
+
+/**
+ * Counters for the local reference frames.
+ */
+typedef struct _S_java_FrameStats {
+    unsigned long frames; /* frames pushed */
+    unsigned long depth_peak; /* most frames pushed at once */
+    unsigned long refs_peak; /* most references reserved at once */
+} java_FrameStats;
+
+extern java_FrameStats java_frame_stats;
+
+
+/**
+ * The type of a Java value, as far as conversions are concerned.
+ */
+enum CVT_JType {
+    CVT_J_VOID,
+    CVT_J_BOOLEAN,
+    CVT_J_BYTE,
+    CVT_J_CHAR,
+    CVT_J_SHORT,
+    CVT_J_INT,
+    CVT_J_LONG,
+    CVT_J_FLOAT,
+    CVT_J_DOUBLE,
+    CVT_J_OBJECT
+};
+#define NB_JPTYPES 9
+#define NB_JTYPES 10
+#define JTYPE_PRIMITIVE(t) ((t) != CVT_J_OBJECT)
+
+/**
+ * How an object obtained from Java is to be converted, decided from its
+ * declared class once and for all (see java_result_kind()).
+ */
+enum JAVA_ResultKind {
+    JAVA_RESULT_WRAP,   /* can't be a String, gets wrapped */
+    JAVA_RESULT_STRING, /* declared as String, gets converted to unicode */
+    JAVA_RESULT_CHECK   /* might be a String (e.g. Object), check each time */
+};
+#define NB_JRESULTS 3
 
 
 typedef struct _S_java_Method {
@@ -23,10 +142,41 @@ typedef struct _S_java_Method {
     char is_static;
     size_t nb_args;
     jclass *args;
+    enum CVT_JType *argtypes; /* java_id_type() of each of args */
     jclass returntype;
+    enum CVT_JType rettype; /* java_id_type(returntype) */
+    enum JAVA_ResultKind retkind; /* java_result_kind(returntype) */
 } java_Method;
 
+/**
+ * An entry of the cache of overload resolutions.
+ *
+ * The key is opaque here, it is built and compared by find_matching_overload()
+ * in javawrapper.c.
+ */
+typedef struct _S_java_CallCache {
+    int what;
+    size_t bound; /* whether the call had a receiver */
+    size_t keylen;
+    const void **key;
+    java_Method *method; /* NULL if the entry is unused */
+    char ambiguous; /* other overloads matched as well */
+} java_CallCache;
+
+#define JAVA_CALLCACHE_SIZE 4
+
+/**
+ * A list of overloads, shared by reference.
+ *
+ * The classes in it are global references, so it can be kept around and
+ * handed to any number of wrappers; use java_incref_methods() and
+ * java_decref_methods() to share it.
+ */
 typedef struct _S_java_Methods {
+    size_t refcount;
+    int what; /* FIELD_STATIC and/or FIELD_NONSTATIC, for the overloads */
+    java_CallCache callcache[JAVA_CALLCACHE_SIZE];
+    size_t callcache_next; /* next entry to be replaced */
     size_t nb_methods;
     java_Method methods[1];
 } java_Methods;
@@ -46,19 +196,96 @@ void java_init(void);
 
 /**
  * Returns all the Java methods with a given name, or NULL if none is found.
+ *
+ * The list has a reference count of 1.
  */
 java_Methods *java_list_methods(jclass javaclass, const char *method,
         int what);
 
+/**
+ * Lists all the public methods of a class, grouped by name.
+ *
+ * This is equivalent to calling java_list_methods() with FIELD_BOTH for each
+ * name, but only goes through the reflected methods once.
+ *
+ * @param names Where to store the array of method names; free() it and each
+ * of its elements.
+ * @param lists Where to store the array of lists, in the same order; free()
+ * it. Each list has a reference count of 1.
+ * @return The number of distinct names.
+ */
+size_t java_list_all_methods(jclass javaclass,
+        char ***names, java_Methods ***lists);
+
 /**
  * Returns all the Java constructors, or NULL if none is found.
  *
  * Constructors are special static methods named "<init>". No return type is
- * set on the java_Method objects returned.
+ * set on the java_Method objects returned (returntype is NULL and rettype is
+ * CVT_J_VOID).
  */
 java_Methods *java_list_constructors(jclass javaclass);
 
-void java_free_methods(java_Methods *methods);
+void java_incref_methods(java_Methods *methods);
+
+/**
+ * Releases a reference to a list of methods, freeing it with the last one.
+ */
+void java_decref_methods(java_Methods *methods);
+
+
+/**
+ * Returns the Java method with a given name and JNI signature, or NULL.
+ *
+ * The signature is in the format used by GetMethodID(), for instance
+ * "(I)Ljava/lang/String;". The method can be static or not.
+ */
+java_Method *java_get_method(jclass javaclass, const char *name,
+        const char *signature);
+
+void java_free_method(java_Method *method);
+
+
+typedef struct _S_java_Field {
+    jfieldID id;
+    char is_static;
+    enum CVT_JType type;
+    jclass javatype; /* global reference */
+    enum JAVA_ResultKind kind; /* java_result_kind(javatype) */
+} java_Field;
+
+/**
+ * Returns the public Java field with a given name, or NULL if none is found.
+ */
+java_Field *java_get_field(jclass javaclass, const char *name);
+
+void java_free_field(java_Field *field);
+
+/**
+ * Lists the names of the public fields of a class.
+ *
+ * @param names Where to store the array of names; free() it and each of its
+ * elements.
+ * @return The number of names.
+ */
+size_t java_list_field_names(jclass javaclass, char ***names);
+
+
+/**
+ * Identifies the type of a Java class, as one of the CVT_J_* constants.
+ *
+ * Every class that is not a primitive type is CVT_J_OBJECT.
+ */
+enum CVT_JType java_id_type(jclass javatype);
+
+
+/**
+ * Decides how objects declared with the given class get converted.
+ *
+ * Only String and its superclasses and interfaces can refer to a String; for
+ * any other class, there is no need to check at runtime.
+ */
+enum JAVA_ResultKind java_result_kind(jclass javatype);
 
 
 /**
@@ -67,6 +294,12 @@ void java_free_methods(java_Methods *methods);
 jclass java_getclass(jobject javaobject);
 
 
+/**
+ * Calls System.identityHashCode() on a Java object.
+ */
+jint java_identity_hash(jobject javaobject);
+
+
 /**
  * Calls Object.equals on two Java objects.
  *
@@ -83,6 +316,73 @@ int java_equals(jobject a, jobject b);
 int java_is_subclass(jclass sub, jclass klass);
 
 
+/**
+ * Returns the superclass of a class, or NULL for Object, interfaces and
+ * primitive types.
+ */
+jclass java_get_superclass(jclass javaclass);
+
+
+/**
+ * Returns the array of the interfaces directly implemented by a class.
+ */
+jobjectArray java_get_interfaces(jclass javaclass);
+
+
+/**
+ * Returns the type of the elements of an array class, or NULL if the class is
+ * not an array.
+ */
+jclass java_get_component_type(jclass javaclass);
+
+
+/**
+ * Pins the elements of an array of primitive type, with
+ * Get<Type>ArrayElements().
+ *
+ * The JVM might give a copy instead of the actual elements; either way, they
+ * have to be given back with java_release_array_elements().
+ *
+ * @param type The type of the elements, which can't be CVT_J_OBJECT or
+ * CVT_J_VOID.
+ * @return A pointer to the elements, or NULL if the JVM ran out of memory.
+ */
+void *java_get_array_elements(jarray array, enum CVT_JType type);
+
+/**
+ * Gives back the elements obtained from java_get_array_elements().
+ *
+ * @param mode As for Release<Type>ArrayElements(): 0 to copy back and release,
+ * JNI_COMMIT to only copy back, JNI_ABORT to release without copying back.
+ */
+void java_release_array_elements(jarray array, enum CVT_JType type,
+        void *elements, jint mode);
+
+
+/**
+ * Returns the size of a value of a primitive type, or 0 for CVT_J_OBJECT and
+ * CVT_J_VOID.
+ */
+size_t java_primitive_size(enum CVT_JType type);
+
+
+/**
+ * Creates an array of a primitive type.
+ *
+ * @return A local reference to the array, or NULL if the JVM ran out of
+ * memory.
+ */
+jarray java_new_array(enum CVT_JType type, jsize length);
+
+
+/**
+ * Copies elements into an array of a primitive type, with
+ * Set<Type>ArrayRegion().
+ */
+void java_set_array_region(jarray array, enum CVT_JType type,
+        jsize start, jsize length, const void *buf);
+
+
 /**
  * Gets the name of a Java class.
  */
@@ -122,20 +422,38 @@ extern jstring str_utf8; /* "UTF-8" */
 
 /* java.lang.Class */
 extern jclass class_Class;
+    extern jmethodID meth_Class_getComponentType;
     extern jmethodID meth_Class_getConstructors;
     extern jmethodID meth_Class_getField;
+    extern jmethodID meth_Class_getFields;
+    extern jmethodID meth_Class_getInterfaces;
     extern jmethodID meth_Class_getMethods;
     extern jmethodID meth_Class_isPrimitive;
 
 /* java.lang.Object */
 extern jclass class_Object;
     extern jmethodID meth_Object_equals;
+    extern jmethodID meth_Object_toString;
+
+/* java.lang.InterruptedException */
+extern jclass class_InterruptedException;
+
+/* java.lang.System */
+extern jclass class_System;
+    extern jmethodID meth_System_identityHashCode;
 
 /* java.lang.String */
 extern jclass class_String;
     extern jmethodID cstr_String_bytes;
     extern jmethodID meth_String_getBytes;
 
+/* java.nio.Buffer */
+extern jclass class_Buffer;
+    extern jmethodID meth_Buffer_isReadOnly;
+
+/* java.nio.ByteBuffer */
+extern jclass class_ByteBuffer;
+
 /* java.lang.reflect.Method */
     extern jmethodID meth_Method_getModifiers;
     extern jmethodID meth_Method_getName;
@@ -144,6 +462,7 @@ extern jclass class_String;
 
 /* java.lang.reflect.Field */
     extern jmethodID meth_Field_getModifiers;
+    extern jmethodID meth_Field_getName;
     extern jmethodID meth_Field_getType;
 
 /* java.lang.reflect.Constructor */
@@ -1,5 +1,8 @@
 #include "javawrapper.h"
 
+#include <structmember.h>
+
+#include "classinfo.h"
 #include "convert.h"
 #include "java.h"
 #include "pyjava.h"
@@ -7,18 +10,225 @@
 
 PyObject *javawrapper_compare(PyObject *o1, PyObject *o2, int op);
 
+extern PyTypeObject JavaInstance_type;
+extern PyTypeObject JavaClass_type;
+extern PyTypeObject JavaArray_type;
+extern PyTypeObject JavaByteBuffer_type;
+extern PyTypeObject InOut_type;
+extern PyTypeObject Scope_type;
+
+
+/*
+ * Every entry point from Python that calls Java runs in a local reference
+ * frame (see java_push_frame()). The capacity is the number of parameters,
+ * which might each need an object to be created (String, array), plus enough
+ * for the result and for wrapping it.
+ */
+#define FRAME_REFS(nbargs) ((jint)(nbargs) + 16)
+
+/* Building a class type lists its members through reflection */
+#define CLASS_FRAME_REFS 64
+
+
+/*==============================================================================
+ * Free lists.
+ *
+ * Wrappers are created and destroyed all the time: a JavaInstance for each
+ * object Java returns, a BoundMethod each time a method is read from an
+ * instance... Like CPython does for floats, the memory of these fixed-size
+ * objects is kept for reuse instead of going back to the allocator. The free
+ * objects are linked through their ob_type field.
+ *
+ * A list only holds objects of a single size, all of them garbage-collected or
+ * none of them.
+ */
+
+#define FREELIST_MAX 256
+
+typedef struct _S_FreeList {
+    PyObject *head;
+    size_t size;
+} FreeList;
+
+static FreeList unboundmethod_freelist = {NULL, 0};
+static FreeList boundmethod_freelist = {NULL, 0};
+static FreeList classmethod_freelist = {NULL, 0};
+static FreeList javainstance_freelist = {NULL, 0};
+
+static unsigned long freelist_hits = 0;
+static unsigned long freelist_misses = 0;
+
+/**
+ * Allocates an object of a fixed-size type, from a free list if possible.
+ *
+ * The object is initialized like PyType_GenericAlloc() does, except that its
+ * fields are not zeroed.
+ */
+static PyObject *freelist_alloc(FreeList *list, PyTypeObject *type)
+{
+    PyObject *obj = list->head;
+    if(obj != NULL)
+    {
+        list->head = (PyObject*)Py_TYPE(obj);
+        list->size--;
+        freelist_hits++;
+    }
+    else
+    {
+        if(PyType_IS_GC(type))
+            obj = _PyObject_GC_Malloc(type->tp_basicsize);
+        else
+            obj = PyObject_MALLOC(type->tp_basicsize);
+        if(obj == NULL)
+            return PyErr_NoMemory();
+        freelist_misses++;
+    }
+    if(type->tp_flags & Py_TPFLAGS_HEAPTYPE)
+        Py_INCREF(type);
+    (void)PyObject_INIT(obj, type);
+    if(PyType_IS_GC(type))
+        PyObject_GC_Track(obj);
+    return obj;
+}
+
+/**
+ * Frees an object allocated by freelist_alloc(), keeping its memory if the
+ * list isn't full.
+ *
+ * A garbage-collected object must already have been untracked.
+ */
+static void freelist_free(FreeList *list, PyObject *obj)
+{
+    if(list->size < FREELIST_MAX)
+    {
+        Py_TYPE(obj) = (PyTypeObject*)list->head;
+        list->head = obj;
+        list->size++;
+    }
+    else if(PyType_IS_GC(Py_TYPE(obj)))
+        PyObject_GC_Del(obj);
+    else
+        PyObject_FREE(obj);
+}
+
+
+/*==============================================================================
+ * Overload resolution.
+ *
+ * The result of a resolution is cached on the java_Methods object, keyed by
+ * the signature of the Python arguments: for each argument, its Python type
+ * and a qualifier, which captures what else convert_check_py2jav() looks at:
+ * the range of an integer, or whether a string is a single character. The type
+ * of a Java object is enough, since each Java class gets its own type.
+ */
+
+#define OVERLOAD_KEY_MAX_ARGS 8
+
+static unsigned long overload_cache_hits = 0;
+static unsigned long overload_cache_misses = 0;
+
+/**
+ * Builds the cache key for a call.
+ *
+ * @returns The length of the key, or 0 if this call can't be cached.
+ */
+static size_t overload_key(PyObject *args, const void **key)
+{
+    size_t nbargs = PyTuple_GET_SIZE(args);
+    size_t i;
+
+    if(nbargs > OVERLOAD_KEY_MAX_ARGS)
+        return 0;
+
+    for(i = 0; i < nbargs; ++i)
+    {
+        PyObject *pyarg = PyTuple_GET_ITEM(args, i);
+        PyTypeObject *type = Py_TYPE(pyarg);
+        size_t qualifier = 0;
+
+        /* Types created from Python code might go away and have their address
+         * reused; those generated for Java classes are never freed */
+        if(Py_TYPE(type) == &JavaClass_type)
+        {
+            key[2*i] = type;
+            key[2*i + 1] = NULL;
+            continue;
+        }
+        else if(type->tp_flags & Py_TPFLAGS_HEAPTYPE)
+            return 0;
+
+        if(PyInt_Check(pyarg) || PyLong_Check(pyarg))
+        {
+            long value = PyInt_AsLong(pyarg);
+            if(value == -1 && PyErr_Occurred())
+            {
+                PyErr_Clear();
+                qualifier = 4; /* doesn't fit in a long */
+            }
+            else if(0 <= value && value <= 255)
+                qualifier = 1; /* fits in a byte */
+            else if(-32768 <= value && value <= 32767)
+                qualifier = 2; /* fits in a short */
+            else
+                qualifier = 3;
+        }
+        else if(PyString_Check(pyarg) || PyUnicode_Check(pyarg))
+            qualifier = PySequence_Length(pyarg) == 1;
+        /* Other buffers (e.g. NumPy arrays) match array parameters depending
+         * on their format, not their type */
+        else if((PyObject_CheckBuffer(pyarg) && !PyByteArray_Check(pyarg))
+              || type == &InOut_type)
+            return 0;
+
+        key[2*i] = type;
+        key[2*i + 1] = (const void*)qualifier;
+    }
+
+    return 2 * nbargs;
+}
 
+/**
+ * Finds the overload matching the Python arguments.
+ *
+ * @param bound 1 if the call has a receiver, which is not part of args and
+ * will be passed as the first parameter of a non-static method (so only
+ * non-static methods should be requested), else 0.
+ */
 static java_Method *find_matching_overload(java_Methods *overloads,
-        PyObject *args, size_t *nonmatches, int what)
+        PyObject *args, size_t bound, size_t *nonmatches, int what)
 {
     size_t nbargs;
     size_t i;
     int matching_method = -1;
     int nb_matches = 1;
+    const void *key[2 * OVERLOAD_KEY_MAX_ARGS];
+    size_t keylen;
 
     nbargs = PyTuple_Size(args);
     *nonmatches = 0;
 
+    /* Look in the cache first */
+    keylen = overload_key(args, key);
+    if(keylen > 0 || nbargs == 0)
+    {
+        for(i = 0; i < JAVA_CALLCACHE_SIZE; ++i)
+        {
+            java_CallCache *entry = &overloads->callcache[i];
+            if(entry->method != NULL && entry->what == what
+             && entry->bound == bound && entry->keylen == keylen
+             && memcmp(entry->key, key, keylen * sizeof(void*)) == 0)
+            {
+                overload_cache_hits++;
+                if(entry->ambiguous)
+                    PyErr_Warn(
+                            PyExc_RuntimeWarning,
+                            "Multiple Java methods matching Python parameters");
+                return entry->method;
+            }
+        }
+    }
+    overload_cache_misses++;
+
     for(i = 0; i < overloads->nb_methods; ++i)
     {
         /* Attempt to match the arguments with the ones we got from Python. */
@@ -29,14 +239,15 @@ static java_Method *find_matching_overload(java_Methods *overloads,
         if( (m->is_static && !(what & FIELD_STATIC))
          || (!m->is_static && !(what & FIELD_NONSTATIC)) )
             continue;
-        if(m->nb_args != nbargs)
+        if(m->nb_args != nbargs + bound)
             continue;
 
-        for(a = 0; a < m->nb_args; ++a)
+        /* The receiver is an instance of the class the overloads come from,
+         * no need to check it */
+        for(a = bound; a < m->nb_args; ++a)
         {
-            jclass javatype = m->args[a];
-            PyObject *pyarg = PyTuple_GET_ITEM(args, a);
-            if(!convert_check_py2jav(pyarg, javatype))
+            PyObject *pyarg = PyTuple_GET_ITEM(args, a - bound);
+            if(!convert_check_py2jav(pyarg, m->argtypes[a], m->args[a]))
             {
                 matches = 0;
                 break;
@@ -68,24 +279,52 @@ static java_Method *find_matching_overload(java_Methods *overloads,
     if(matching_method == -1)
         return NULL;
 
+    /* Remember the resolution */
+    if(keylen > 0 || nbargs == 0)
+    {
+        java_CallCache *entry =
+                &overloads->callcache[overloads->callcache_next];
+        free(entry->key);
+        entry->what = what;
+        entry->bound = bound;
+        entry->keylen = keylen;
+        entry->key = malloc((keylen + 1) * sizeof(void*));
+        memcpy(entry->key, key, keylen * sizeof(void*));
+        entry->method = &overloads->methods[matching_method];
+        entry->ambiguous = nb_matches > 1;
+        overloads->callcache_next =
+                (overloads->callcache_next + 1) % JAVA_CALLCACHE_SIZE;
+    }
+
     return &overloads->methods[matching_method];
 }
 
 
+#define METHOD_STACK_ARGS 8
+
+/**
+ * Calls the overload matching the Python arguments.
+ *
+ * @param javaclass The class, for static methods.
+ * @param receiver The object non-static methods are called on, or NULL if it
+ * is the first of the Python arguments.
+ */
 static PyObject *_method_call(java_Methods *overloads,
-        jclass javaclass, PyObject *args, int what)
+        jclass javaclass, jobject receiver, PyObject *args, int what)
 {
     size_t nbargs = PyTuple_Size(args);
+    size_t bound = (receiver != NULL)?1:0;
     PyObject *ret = NULL;
-    jvalue *java_parameters;
+    jvalue stack_parameters[METHOD_STACK_ARGS];
+    jvalue *java_parameters = stack_parameters;
+    size_t converted, i;
 
     size_t nonmatches;
     java_Method *matching_method = find_matching_overload(overloads,
-            args, &nonmatches, what);
+            args, bound, &nonmatches, what);
 
     if(matching_method == NULL)
     {
-        size_t nbargs = PyTuple_Size(args);
         PyErr_Format(
                 Err_NoMatchingOverload,
                 "%zu methods with %zd parameters (no match)",
@@ -93,14 +332,20 @@ static PyObject *_method_call(java_Methods *overloads,
         return NULL;
     }
 
-    java_parameters = malloc(sizeof(jvalue) * nbargs);
+    if(!java_push_frame(FRAME_REFS(nbargs)))
+        return PyErr_NoMemory();
+    if(nbargs + bound > METHOD_STACK_ARGS)
+        java_parameters = malloc(sizeof(jvalue) * (nbargs + bound));
+    if(bound)
+        java_parameters[0].l = receiver;
+    for(converted = 0; converted < nbargs; ++converted)
     {
-        size_t i;
-        for(i = 0; i < nbargs; ++i)
-            convert_py2jav(
-                    PyTuple_GET_ITEM(args, i),
-                    matching_method->args[i],
-                    &java_parameters[i]);
+        if(!convert_py2jav(
+                PyTuple_GET_ITEM(args, converted),
+                matching_method->argtypes[converted + bound],
+                matching_method->args[converted + bound],
+                &java_parameters[converted + bound]))
+            goto end;
     }
 
     if(matching_method->is_static)
@@ -108,19 +353,28 @@ static PyObject *_method_call(java_Methods *overloads,
         ret = convert_calljava_static(
                 javaclass, matching_method->id,
                 java_parameters,
-                matching_method->returntype);
+                matching_method->rettype, matching_method->retkind);
     }
     else if(!matching_method->is_static)
     {
         ret = convert_calljava(
                 java_parameters[0].l, matching_method->id,
                 java_parameters+1,
-                matching_method->returntype);
+                matching_method->rettype, matching_method->retkind);
     }
 
-    free(java_parameters);
+end:
+    /* Only the parameters before 'converted' need to be released */
+    for(i = 0; i < converted; ++i)
+        convert_py2jav_release(
+                PyTuple_GET_ITEM(args, i),
+                matching_method->argtypes[i + bound],
+                &java_parameters[i + bound]);
+    java_pop_frame(NULL);
+    if(java_parameters != stack_parameters)
+        free(java_parameters);
 
-    if(ret == NULL)
+    if(ret == NULL && !PyErr_Occurred())
     {
         PyErr_Format(
                 Err_NoMatchingOverload,
@@ -131,6 +385,211 @@ static PyObject *_method_call(java_Methods *overloads,
 }
 
 
+/*==============================================================================
+ * MethodHandle type.
+ *
+ * This represents a single Java method, selected by its JNI signature through
+ * the overload() method of the other method wrappers. Calling it skips the
+ * overload resolution: the converters for the parameters and the return value
+ * are chosen once, when the handle is created.
+ * If the method is not static, it might be bound to an instance; else the
+ * first argument is used as 'self'.
+ * Its release_gil attribute can be cleared for methods so short that
+ * releasing the GIL would cost more than the call.
+ */
+
+typedef struct _S_MethodHandle {
+    PyObject_HEAD
+    jclass javaclass;
+    jobject javainstance; /* instance it is bound to, or NULL */
+    java_Method *method;
+    convert_ArgFunc *argfuncs;
+    convert_CallFunc callfunc;
+    char release_gil;
+} MethodHandle;
+
+static PyObject *MethodHandle_call(PyObject *v_self,
+        PyObject *args, PyObject *kwargs)
+{
+    MethodHandle *self = (MethodHandle*)v_self;
+    java_Method *m = self->method;
+    size_t nbargs = PyTuple_GET_SIZE(args);
+    size_t bound = (self->javainstance != NULL)?1:0;
+    jvalue stack_parameters[METHOD_STACK_ARGS];
+    jvalue *java_parameters = stack_parameters;
+    PyObject *ret = NULL;
+    size_t i;
+
+    if(nbargs + bound != m->nb_args)
+    {
+        PyErr_Format(
+                PyExc_TypeError,
+                "method takes %zu parameters (%zu given)",
+                m->nb_args - bound, nbargs);
+        return NULL;
+    }
+
+    if(!java_push_frame(FRAME_REFS(m->nb_args)))
+        return PyErr_NoMemory();
+    if(m->nb_args > METHOD_STACK_ARGS)
+        java_parameters = malloc(sizeof(jvalue) * m->nb_args);
+
+    if(bound)
+        java_parameters[0].l = self->javainstance;
+    for(i = bound; i < m->nb_args; ++i)
+    {
+        if(!self->argfuncs[i](PyTuple_GET_ITEM(args, i - bound),
+                              m->args[i], &java_parameters[i]))
+            goto end;
+    }
+
+    if(m->is_static)
+        ret = self->callfunc(self->javaclass, m->id, java_parameters,
+                             self->release_gil && convert_release_gil);
+    else
+        ret = self->callfunc(java_parameters[0].l, m->id,
+                             java_parameters + 1,
+                             self->release_gil && convert_release_gil);
+
+end:
+    /* Only the parameters before i have been converted */
+    while(i-- > bound)
+        convert_py2jav_release(PyTuple_GET_ITEM(args, i - bound),
+                               m->argtypes[i], &java_parameters[i]);
+    java_pop_frame(NULL);
+    if(java_parameters != stack_parameters)
+        free(java_parameters);
+    return ret;
+}
+
+static void MethodHandle_dealloc(PyObject *v_self)
+{
+    MethodHandle *self = (MethodHandle*)v_self;
+
+    if(self->method != NULL)
+        java_free_method(self->method);
+    free(self->argfuncs);
+    if(self->javaclass != NULL)
+        (*penv)->DeleteGlobalRef(penv, self->javaclass);
+    if(self->javainstance != NULL)
+        (*penv)->DeleteGlobalRef(penv, self->javainstance);
+
+    self->ob_type->tp_free(self);
+}
+
+static PyMemberDef MethodHandle_members[] = {
+    {"release_gil", T_BOOL, offsetof(MethodHandle, release_gil), 0,
+    "Whether the GIL is released while the method runs (if it isn't\n"
+    "disabled globally by _pyjava.release_gil())."
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject MethodHandle_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.MethodHandle",     /*tp_name*/
+    sizeof(MethodHandle),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    MethodHandle_dealloc,      /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    MethodHandle_call,         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Java method with a fixed signature", /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    0,                         /*tp_methods*/
+    MethodHandle_members,      /*tp_members*/
+    0,                         /*tp_getset*/
+    0,                         /*tp_base*/
+    0,                         /*tp_dict*/
+    0,                         /*tp_descr_get*/
+    0,                         /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    0,                         /*tp_new*/
+};
+
+/**
+ * Implementation of overload() for the method wrappers.
+ *
+ * @param javaclass Class on which the method is looked up.
+ * @param javainstance Object a non-static method is bound to, or NULL.
+ * @param args The Python arguments, i.e. the signature.
+ * @param what Which kinds of methods can be selected.
+ */
+static PyObject *method_handle_new(jclass javaclass, jobject javainstance,
+        const char *name, PyObject *args, int what)
+{
+    MethodHandle *handle;
+    java_Method *m;
+    const char *signature;
+    size_t i;
+
+    if(!PyArg_ParseTuple(args, "s:overload", &signature))
+        return NULL;
+
+    m = java_get_method(javaclass, name, signature);
+    if(m != NULL
+     && ( (m->is_static && !(what & FIELD_STATIC))
+       || (!m->is_static && !(what & FIELD_NONSTATIC)) ))
+    {
+        java_free_method(m);
+        m = NULL;
+    }
+    if(m == NULL)
+    {
+        PyErr_Format(
+                Err_NoMatchingOverload,
+                "no method %s with signature %s",
+                name, signature);
+        return NULL;
+    }
+
+    handle = PyObject_New(MethodHandle, &MethodHandle_type);
+    handle->javaclass = (*penv)->NewGlobalRef(penv, javaclass);
+    if(javainstance != NULL && !m->is_static)
+        handle->javainstance = (*penv)->NewGlobalRef(penv, javainstance);
+    else
+        handle->javainstance = NULL;
+    handle->method = m;
+    handle->release_gil = 1;
+    handle->argfuncs = malloc(sizeof(convert_ArgFunc) * (m->nb_args + 1));
+    for(i = 0; i < m->nb_args; ++i)
+        handle->argfuncs[i] = convert_argfunc(m->argtypes[i]);
+    if(m->is_static)
+        handle->callfunc = convert_callstaticfunc(m->rettype, m->retkind);
+    else
+        handle->callfunc = convert_callfunc(m->rettype, m->retkind);
+
+    return (PyObject*)handle;
+}
+
+#define OVERLOAD_DOC \
+    "overload(signature) -> MethodHandle\n" \
+    "\n" \
+    "Selects the method with the given JNI signature, for instance\n" \
+    "'(I)Ljava/lang/String;'. Calling the returned handle skips the overload\n" \
+    "resolution."
+
+
 /*==============================================================================
  * UnboundMethod type.
  *
@@ -144,10 +603,10 @@ static PyObject *_method_call(java_Methods *overloads,
  */
 
 typedef struct _S_UnboundMethod {
-    PyObject_VAR_HEAD
+    PyObject_HEAD
     jclass javaclass;
     java_Methods *overloads;
-    char name[1];
+    PyObject *name;
 } UnboundMethod;
 
 static PyObject *UnboundMethod_call(PyObject *v_self,
@@ -155,19 +614,36 @@ static PyObject *UnboundMethod_call(PyObject *v_self,
 {
     UnboundMethod *self = (UnboundMethod*)v_self;
 
-    return _method_call(self->overloads, self->javaclass, args, FIELD_BOTH);
+    return _method_call(self->overloads, self->javaclass, NULL, args,
+                        FIELD_BOTH);
+}
+
+static PyObject *UnboundMethod_overload(UnboundMethod *self, PyObject *args)
+{
+    return method_handle_new(self->javaclass, NULL,
+                             PyString_AS_STRING(self->name), args,
+                             FIELD_BOTH);
 }
 
+static PyMethodDef UnboundMethod_methods[] = {
+    {"overload", (PyCFunction)UnboundMethod_overload, METH_VARARGS,
+    OVERLOAD_DOC
+    },
+    {NULL}  /* Sentinel */
+};
+
 static void UnboundMethod_dealloc(PyObject *v_self)
 {
     UnboundMethod *self = (UnboundMethod*)v_self;
 
     if(self->overloads != NULL)
-        java_free_methods(self->overloads);
+        java_decref_methods(self->overloads);
     if(self->javaclass != NULL)
         (*penv)->DeleteGlobalRef(penv, self->javaclass);
 
-    self->ob_type->tp_free(self);
+    Py_XDECREF(self->name);
+
+    freelist_free(&unboundmethod_freelist, v_self);
 }
 
 static PyTypeObject UnboundMethod_type = {
@@ -175,7 +651,7 @@ static PyTypeObject UnboundMethod_type = {
     0,                         /*ob_size*/
     "pyjava.UnboundMethod",    /*tp_name*/
     sizeof(UnboundMethod),     /*tp_basicsize*/
-    1,                         /*tp_itemsize*/
+    0,                         /*tp_itemsize*/
     UnboundMethod_dealloc,     /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
@@ -199,7 +675,7 @@ static PyTypeObject UnboundMethod_type = {
     0,                         /*tp_weaklistoffset*/
     0,                         /*tp_iter*/
     0,                         /*tp_iternext*/
-    0,                         /*tp_methods*/
+    UnboundMethod_methods,     /*tp_methods*/
     0,                         /*tp_members*/
     0,                         /*tp_getset*/
     0,                         /*tp_base*/
@@ -209,9 +685,25 @@ static PyTypeObject UnboundMethod_type = {
     0,                         /*tp_dictoffset*/
     0,                         /*tp_init*/
     0,                         /*tp_alloc*/
-    PyType_GenericNew,         /*tp_new*/
+    0,                         /*tp_new*/
 };
 
+static PyObject *unboundmethod_new(jclass javaclass, java_Methods *overloads,
+        PyObject *name)
+{
+    UnboundMethod *wrapper = (UnboundMethod*)freelist_alloc(
+            &unboundmethod_freelist, &UnboundMethod_type);
+    if(wrapper == NULL)
+        return NULL;
+    wrapper->javaclass = (*penv)->NewGlobalRef(penv, javaclass);
+    java_incref_methods(overloads);
+    wrapper->overloads = overloads;
+    Py_INCREF(name);
+    wrapper->name = name;
+
+    return (PyObject*)wrapper;
+}
+
 
 /*==============================================================================
  * BoundMethod type.
@@ -219,52 +711,66 @@ static PyTypeObject UnboundMethod_type = {
  * This represents a bound method, i.e. a method obtained from an instance.
  * It is associated with the instance it was retrieved from. When called, it
  * will be matched only with the nonstatic methods of that class, and will use
- * the instance it is bound to as the self argument. It contains the jclass,
- * the jobject, and the name of the method.
+ * the instance it is bound to as the self argument. It contains the class
+ * record, the Python instance, and the name of the method; no JNI reference
+ * is created, as the instance already holds one (and the class record lives
+ * for the whole process). If a scope releases the instance, the method can't
+ * be called anymore either.
  * There is no jmethodID here because this object wraps all the Java methods
  * with the same name, and the actual decision will occur when the call is
  * made (and the parameter types are known).
  */
 
 typedef struct _S_BoundMethod {
-    PyObject_VAR_HEAD
-    jclass javaclass;
-    jobject javainstance;
+    PyObject_HEAD
+    ClassInfo *info;
+    PyObject *instance; /* the JavaInstance */
     java_Methods *overloads;
-    char name[1];
+    PyObject *name;
 } BoundMethod;
 
+static jobject instance_javaobject(PyObject *inst);
+
 static PyObject *BoundMethod_call(PyObject *v_self,
         PyObject *args, PyObject *kwargs)
 {
     BoundMethod *self = (BoundMethod*)v_self;
+    jobject javaobject = instance_javaobject(self->instance);
 
-    /* args = (self,) + args */
-    {
-        PyObject *wrapped_obj = javawrapper_wrap_instance(self->javainstance);
-        PyObject *first_arg = Py_BuildValue("(O)", wrapped_obj);
-        Py_DECREF(wrapped_obj);
-        args = PySequence_Concat(first_arg, args);
-        /* the original 'args' object is deleted by Python anyway */
-        Py_DECREF(first_arg);
-    }
+    if(javaobject == NULL)
+        return NULL;
+    return _method_call(self->overloads, self->info->javaclass, javaobject,
+                        args, FIELD_NONSTATIC);
+}
+
+static PyObject *BoundMethod_overload(BoundMethod *self, PyObject *args)
+{
+    jobject javaobject = instance_javaobject(self->instance);
 
-    return _method_call(self->overloads, self->javaclass, args,
-                        FIELD_NONSTATIC);
+    if(javaobject == NULL)
+        return NULL;
+    return method_handle_new(self->info->javaclass, javaobject,
+                             PyString_AS_STRING(self->name),
+                             args, FIELD_NONSTATIC);
 }
 
+static PyMethodDef BoundMethod_methods[] = {
+    {"overload", (PyCFunction)BoundMethod_overload, METH_VARARGS,
+    OVERLOAD_DOC
+    },
+    {NULL}  /* Sentinel */
+};
+
 static void BoundMethod_dealloc(PyObject *v_self)
 {
     BoundMethod *self = (BoundMethod*)v_self;
 
     if(self->overloads != NULL)
-        java_free_methods(self->overloads);
-    if(self->javaclass != NULL)
-        (*penv)->DeleteGlobalRef(penv, self->javaclass);
-    if(self->javainstance != NULL)
-        (*penv)->DeleteGlobalRef(penv, self->javainstance);
+        java_decref_methods(self->overloads);
+    Py_XDECREF(self->instance);
+    Py_XDECREF(self->name);
 
-    self->ob_type->tp_free(self);
+    freelist_free(&boundmethod_freelist, v_self);
 }
 
 static PyTypeObject BoundMethod_type = {
@@ -272,7 +778,7 @@ static PyTypeObject BoundMethod_type = {
     0,                         /*ob_size*/
     "pyjava.BoundMethod",      /*tp_name*/
     sizeof(BoundMethod),       /*tp_basicsize*/
-    1,                         /*tp_itemsize*/
+    0,                         /*tp_itemsize*/
     BoundMethod_dealloc,       /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
@@ -296,7 +802,7 @@ static PyTypeObject BoundMethod_type = {
     0,                         /*tp_weaklistoffset*/
     0,                         /*tp_iter*/
     0,                         /*tp_iternext*/
-    0,                         /*tp_methods*/
+    BoundMethod_methods,       /*tp_methods*/
     0,                         /*tp_members*/
     0,                         /*tp_getset*/
     0,                         /*tp_base*/
@@ -306,17 +812,37 @@ static PyTypeObject BoundMethod_type = {
     0,                         /*tp_dictoffset*/
     0,                         /*tp_init*/
     0,                         /*tp_alloc*/
-    PyType_GenericNew,         /*tp_new*/
+    0,                         /*tp_new*/
 };
 
+static PyObject *boundmethod_new(ClassInfo *info, PyObject *instance,
+        java_Methods *overloads, PyObject *name)
+{
+    BoundMethod *wrapper = (BoundMethod*)freelist_alloc(
+            &boundmethod_freelist, &BoundMethod_type);
+    if(wrapper == NULL)
+        return NULL;
+    wrapper->info = info;
+    Py_INCREF(instance);
+    wrapper->instance = instance;
+    java_incref_methods(overloads);
+    wrapper->overloads = overloads;
+    Py_INCREF(name);
+    wrapper->name = name;
+
+    return (PyObject*)wrapper;
+}
+
 
 /*==============================================================================
  * ClassMethod type.
  *
  * This represents a Class method obtained from a JavaClass.
- * If the class is Java's Class, 'overloads' contains methods that are static
- * or unbound. If a non-static method is called, we don't want it to be bound
- * to Class but rather to use the first argument as 'self'.
+ * 'overloads' is the shared list of the Class methods with that name; 'what'
+ * tells which can be called unbound: if the class is Java's Class, methods
+ * that are static or unbound, else only unbound ones. If a non-static method
+ * is called, we don't want it to be bound to Class but rather to use the first
+ * argument as 'self'.
  * It contains the jclass, the jobject, and the name of the method.
  * There is no jmethodID here because this object wraps all the Java methods
  * with the same name, and the actual decision will occur when the call is made
@@ -324,10 +850,11 @@ static PyTypeObject BoundMethod_type = {
  */
 
 typedef struct _S_ClassMethod {
-    PyObject_VAR_HEAD
+    PyObject_HEAD
     jclass javaclass;
     java_Methods *overloads;
-    char name[1];
+    int what; /* which of the overloads can be called unbound */
+    PyObject *name;
 } ClassMethod;
 
 static PyObject *ClassMethod_call(PyObject *v_self,
@@ -335,41 +862,51 @@ static PyObject *ClassMethod_call(PyObject *v_self,
 {
     ClassMethod *self = (ClassMethod*)v_self;
 
+    /* Attempts bound method call, with the class as the receiver */
     {
-        PyObject *b_args;
-        PyObject *result;
-        /* b_args = (self,) + args */
-        {
-            PyObject *wrapped_obj = javawrapper_wrap_class(self->javaclass);
-            PyObject *first_arg = Py_BuildValue("(O)", wrapped_obj);
-            Py_DECREF(wrapped_obj);
-            b_args = PySequence_Concat(first_arg, args);
-            Py_DECREF(first_arg);
-        }
-
-        /* Attempts bound method call */
-        result = _method_call(self->overloads, class_Class, b_args,
-                              FIELD_NONSTATIC);
-        Py_DECREF(b_args);
-        if(result != NULL)
+        PyObject *result = _method_call(self->overloads, class_Class,
+                                        self->javaclass, args,
+                                        FIELD_NONSTATIC);
+        /* Only a failed overload resolution means another try; exceptions
+         * thrown by the method are raised */
+        if(result != NULL
+         || !PyErr_ExceptionMatches(Err_NoMatchingOverload))
             return result;
         PyErr_Clear();
     }
 
     /* Attempts unbound method call */
-    return _method_call(self->overloads, self->javaclass, args, FIELD_BOTH);
+    return _method_call(self->overloads, self->javaclass, NULL, args,
+                        self->what);
+}
+
+static PyObject *ClassMethod_overload(ClassMethod *self, PyObject *args)
+{
+    /* Non-static Class methods get bound to the class */
+    return method_handle_new(class_Class, self->javaclass,
+                             PyString_AS_STRING(self->name), args,
+                             self->what | FIELD_NONSTATIC);
 }
 
+static PyMethodDef ClassMethod_methods[] = {
+    {"overload", (PyCFunction)ClassMethod_overload, METH_VARARGS,
+    OVERLOAD_DOC
+    },
+    {NULL}  /* Sentinel */
+};
+
 static void ClassMethod_dealloc(PyObject *v_self)
 {
     ClassMethod *self = (ClassMethod*)v_self;
 
     if(self->overloads != NULL)
-        java_free_methods(self->overloads);
+        java_decref_methods(self->overloads);
     if(self->javaclass != NULL)
         (*penv)->DeleteGlobalRef(penv, self->javaclass);
 
-    self->ob_type->tp_free(self);
+    Py_XDECREF(self->name);
+
+    freelist_free(&classmethod_freelist, v_self);
 }
 
 static PyTypeObject ClassMethod_type = {
@@ -377,7 +914,7 @@ static PyTypeObject ClassMethod_type = {
     0,                         /*ob_size*/
     "pyjava.ClassMethod",      /*tp_name*/
     sizeof(ClassMethod),       /*tp_basicsize*/
-    1,                         /*tp_itemsize*/
+    0,                         /*tp_itemsize*/
     ClassMethod_dealloc,       /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
@@ -401,7 +938,7 @@ static PyTypeObject ClassMethod_type = {
     0,                         /*tp_weaklistoffset*/
     0,                         /*tp_iter*/
     0,                         /*tp_iternext*/
-    0,                         /*tp_methods*/
+    ClassMethod_methods,       /*tp_methods*/
     0,                         /*tp_members*/
     0,                         /*tp_getset*/
     0,                         /*tp_base*/
@@ -411,115 +948,328 @@ static PyTypeObject ClassMethod_type = {
     0,                         /*tp_dictoffset*/
     0,                         /*tp_init*/
     0,                         /*tp_alloc*/
-    PyType_GenericNew,         /*tp_new*/
+    0,                         /*tp_new*/
 };
 
+static PyObject *classmethod_new(jclass javaclass, java_Methods *overloads,
+        int what, PyObject *name)
+{
+    ClassMethod *wrapper = (ClassMethod*)freelist_alloc(
+            &classmethod_freelist, &ClassMethod_type);
+    if(wrapper == NULL)
+        return NULL;
+    wrapper->javaclass = (*penv)->NewGlobalRef(penv, javaclass);
+    java_incref_methods(overloads);
+    wrapper->overloads = overloads;
+    wrapper->what = what;
+    Py_INCREF(name);
+    wrapper->name = name;
+
+    return (PyObject*)wrapper;
+}
+
 
 /*==============================================================================
  * JavaInstance type.
  *
  * This is the wrapper for Java instance objects; it contains a jobject.
+ * Java objects are never bare JavaInstances but instances of the type
+ * generated for their class (see JavaClass below), which derives from it.
  */
 
 typedef struct _S_JavaInstance {
     PyObject_HEAD
     jobject javaobject;
+    /* Membership in the identity map (see below) */
+    char identity_mapped;
+    jint identity_hash;
+    struct _S_JavaInstance *identity_next;
+    /* The scope that created this instance, and its index there; see the
+     * Scope type */
+    struct _S_Scope *scope;
+    size_t scope_index;
+    char local_ref; /* javaobject is a local reference */
 } JavaInstance;
 
-static PyObject *JavaInstance_getattr(PyObject *v_self, PyObject *attr_name)
-{
-    JavaInstance *self = (JavaInstance*)v_self;
-    Py_ssize_t namelen;
-    jclass javaclass;
-    const char *name = PyString_AsString(attr_name); /* UTF-8 */
-    if(name == NULL)
-        return NULL; /* TypeError from PyString_AsString() */
-    namelen = PyString_GET_SIZE(attr_name);
-    javaclass = java_getclass(self->javaobject);
+/*
+ * Scopes record the instances created while they are active, to release them
+ * all at once when they exit; see the Scope type below.
+ */
 
-    /* First, try to find a method with that name, in that class.
-     * If at least one such method exists, we return a BoundMethod. */
-    {
-        java_Methods *methods = java_list_methods(javaclass, name,
-                                                  FIELD_BOTH);
-        if(methods != NULL)
+typedef struct _S_Scope {
+    PyObject_HEAD
+    char local; /* instances hold local references, in a flat frame */
+    char active;
+    JNIEnv *env; /* of the thread it is active on */
+    /* Instances created in this scope; NULL where one was freed or kept */
+    JavaInstance **instances;
+    size_t nb_instances;
+    size_t size;
+    struct _S_Scope *parent;
+} Scope;
+
+/* Innermost active scope of this thread, or NULL */
+static JAVA_THREAD_LOCAL Scope *current_scope = NULL;
+
+static void scope_record(Scope *scope, JavaInstance *inst)
+{
+    if(scope->nb_instances == scope->size)
+    {
+        scope->size = (scope->size == 0)?64:(2 * scope->size);
+        scope->instances = realloc(scope->instances,
+                                   sizeof(JavaInstance*) * scope->size);
+    }
+    inst->scope = scope;
+    inst->scope_index = scope->nb_instances;
+    scope->instances[scope->nb_instances++] = inst;
+}
+
+static void scope_forget(JavaInstance *inst)
+{
+    inst->scope->instances[inst->scope_index] = NULL;
+    inst->scope = NULL;
+}
+
+/**
+ * Indicates whether an instance was created on the current thread, which is
+ * required to use it if it holds a local reference.
+ */
+static int instance_on_thread(JavaInstance *inst)
+{
+    return inst->scope != NULL && inst->scope->env == java_thread_env;
+}
+
+/**
+ * Checks that an instance still holds its object, i.e. that it wasn't
+ * released by a scope.
+ */
+static int instance_check(JavaInstance *inst)
+{
+    if(inst->javaobject == NULL)
+    {
+        PyErr_SetString(
+                Err_Base,
+                "Java object was released when its scope exited");
+        return 0;
+    }
+    else if(inst->local_ref && !instance_on_thread(inst))
+    {
+        PyErr_SetString(
+                Err_Base,
+                "Java object is a local reference of another thread");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns the object of an instance, or NULL with an exception set if
+ * instance_check() fails.
+ */
+static jobject instance_javaobject(PyObject *inst)
+{
+    if(!instance_check((JavaInstance*)inst))
+        return NULL;
+    return ((JavaInstance*)inst)->javaobject;
+}
+
+/**
+ * Replaces the local reference of an instance by a global one, so that it
+ * survives its scope.
+ */
+static void instance_promote(JavaInstance *inst)
+{
+    if(inst->local_ref)
+    {
+        jobject global = (*penv)->NewGlobalRef(penv, inst->javaobject);
+        (*penv)->DeleteLocalRef(penv, inst->javaobject);
+        inst->javaobject = global;
+        inst->local_ref = 0;
+    }
+}
+
+
+/*
+ * Identity map.
+ *
+ * When enabled (see javawrapper_set_identity_cache()), a Java object that
+ * already has a wrapper gets the same wrapper again instead of a new one and
+ * a new global reference. The map is a hash table keyed by
+ * System.identityHashCode(), chained through the instances; the hash is only a
+ * hint, IsSameObject() tells which instance is the right one. It doesn't hold
+ * references: instances remove themselves when they are freed.
+ */
+
+#define IDENTITY_MIN_BUCKETS 256
+
+static int identity_enabled = 0;
+static JavaInstance **identity_buckets = NULL;
+static size_t identity_nb_buckets = 0; /* power of 2 */
+static size_t identity_size = 0;
+
+static unsigned long identity_cache_hits = 0;
+static unsigned long identity_cache_misses = 0;
+
+static JavaInstance **identity_bucket(jint hash)
+{
+    return &identity_buckets[(size_t)(unsigned int)hash &
+                             (identity_nb_buckets - 1)];
+}
+
+/**
+ * Finds the wrapper of an object in the identity map.
+ *
+ * @returns A borrowed reference, or NULL.
+ */
+static JavaInstance *identity_lookup(jobject javaobject, jint hash)
+{
+    JavaInstance *inst;
+
+    if(identity_buckets == NULL)
+        return NULL;
+    for(inst = *identity_bucket(hash); inst != NULL; inst = inst->identity_next)
+    {
+        if(inst->identity_hash != hash ||
+                (inst->local_ref && !instance_on_thread(inst)))
+            continue;
+        if((*penv)->IsSameObject(penv, inst->javaobject, javaobject))
+            return inst;
+    }
+    return NULL;
+}
+
+static void identity_insert(JavaInstance *inst, jint hash)
+{
+    JavaInstance **bucket;
+
+    /* Grows the table to keep the chains short */
+    if(identity_size >= identity_nb_buckets * 2)
+    {
+        size_t old_nb_buckets = identity_nb_buckets;
+        JavaInstance **old_buckets = identity_buckets;
+        size_t i;
+
+        identity_nb_buckets = (old_nb_buckets == 0)?IDENTITY_MIN_BUCKETS:
+                                                    old_nb_buckets * 2;
+        identity_buckets = calloc(identity_nb_buckets, sizeof(JavaInstance*));
+        for(i = 0; i < old_nb_buckets; ++i)
+        {
+            JavaInstance *next, *moved = old_buckets[i];
+            for(; moved != NULL; moved = next)
+            {
+                next = moved->identity_next;
+                bucket = identity_bucket(moved->identity_hash);
+                moved->identity_next = *bucket;
+                *bucket = moved;
+            }
+        }
+        free(old_buckets);
+    }
+
+    bucket = identity_bucket(hash);
+    inst->identity_mapped = 1;
+    inst->identity_hash = hash;
+    inst->identity_next = *bucket;
+    *bucket = inst;
+    identity_size++;
+}
+
+static void identity_remove(JavaInstance *inst)
+{
+    JavaInstance **link = identity_bucket(inst->identity_hash);
+    for(; *link != NULL; link = &(*link)->identity_next)
+    {
+        if(*link == inst)
         {
-            BoundMethod *wrapper = PyObject_NewVar(BoundMethod,
-                    &BoundMethod_type, namelen);
-            wrapper->javaclass = (*penv)->NewGlobalRef(penv, javaclass);
-            wrapper->javainstance = (*penv)->NewGlobalRef(penv,
-                                                          self->javaobject);
-            wrapper->overloads = methods;
-            memcpy(wrapper->name, name, namelen);
-            wrapper->name[namelen] = '\0';
-
-            return (PyObject*)wrapper;
+            *link = inst->identity_next;
+            identity_size--;
+            break;
         }
     }
+    inst->identity_mapped = 0;
+}
+
+int javawrapper_set_identity_cache(int enabled)
+{
+    int previous = identity_enabled;
+    identity_enabled = enabled;
 
-    /* Then, try a field (nonstatic) */
+    /* Forgets the wrappers, they might outlive the next activation */
+    if(!enabled && identity_buckets != NULL)
     {
-        PyObject *field = convert_getjavafield(javaclass, self->javaobject,
-                                               name, FIELD_NONSTATIC);
-        if(field != NULL)
+        size_t i;
+        for(i = 0; i < identity_nb_buckets; ++i)
         {
-            (*penv)->DeleteLocalRef(penv, javaclass);
-            return field;
+            JavaInstance *inst = identity_buckets[i];
+            for(; inst != NULL; inst = inst->identity_next)
+                inst->identity_mapped = 0;
         }
+        free(identity_buckets);
+        identity_buckets = NULL;
+        identity_nb_buckets = 0;
+        identity_size = 0;
     }
 
-    /* We didn't find anything, raise AttributeError */
-    PyErr_Format(
-            PyExc_AttributeError,
-            "Java instance has no attribute %s",
-            name);
-    (*penv)->DeleteLocalRef(penv, javaclass);
-    return NULL;
+    return previous;
 }
 
-static int JavaInstance_setattr(PyObject *v_self, PyObject *attr_name,
-        PyObject *value)
-{
-    JavaInstance *self = (JavaInstance*)v_self;
-    jclass javaclass;
-    int res;
-    const char *name = PyString_AsString(attr_name); /* UTF-8 */
-    if(name == NULL)
-        return -1; /* TypeError from PyString_AsString() */
-    javaclass = java_getclass(self->javaobject);
+/* The generated types that add nothing to JavaInstance (i.e. not arrays) share
+ * a free list */
+#define INSTANCE_FREELIST_OK(type) ( \
+        ((type)->tp_flags & Py_TPFLAGS_HEAPTYPE) && \
+        (type)->tp_basicsize == sizeof(JavaInstance))
 
-    res = convert_setjavafield(javaclass, self->javaobject, name,
-                               FIELD_NONSTATIC, value);
-    if(res == 1)
+/**
+ * Creates an instance of a generated type, wrapping the given object.
+ */
+static PyObject *javainstance_new(PyTypeObject *type, jobject javaobject)
+{
+    JavaInstance *inst;
+    if(INSTANCE_FREELIST_OK(type))
+        inst = (JavaInstance*)freelist_alloc(&javainstance_freelist, type);
+    else
+        inst = (JavaInstance*)type->tp_alloc(type, 0);
+    if(inst == NULL)
+        return NULL;
+    inst->identity_mapped = 0;
+    inst->scope = NULL;
+    if(current_scope != NULL && current_scope->local)
     {
-        (*penv)->DeleteLocalRef(penv, javaclass);
-        return 0;
+        inst->javaobject = (*penv)->NewLocalRef(penv, javaobject);
+        inst->local_ref = 1;
     }
     else
     {
-        if(res == 0)
-            PyErr_Format(
-                    Err_FieldTypeError,
-                    "Java nonstatic attribute %s has incompatible type",
-                    name);
-        else /* res == -1 */
-            PyErr_Format(
-                    PyExc_AttributeError,
-                    "Java class has no nonstatic attribute %s",
-                    name);
-        (*penv)->DeleteLocalRef(penv, javaclass);
-        return -1;
+        inst->javaobject = (*penv)->NewGlobalRef(penv, javaobject);
+        inst->local_ref = 0;
     }
+    if(current_scope != NULL)
+        scope_record(current_scope, inst);
+    return (PyObject*)inst;
 }
 
 static void JavaInstance_dealloc(PyObject *v_self)
 {
     JavaInstance *self = (JavaInstance*)v_self;
 
-    if(self->javaobject != NULL)
+    if(self->identity_mapped)
+        identity_remove(self);
+    /* Other threads can't free a local reference, it goes with the frame */
+    if(self->javaobject != NULL && self->local_ref)
+    {
+        if(instance_on_thread(self))
+            (*penv)->DeleteLocalRef(penv, self->javaobject);
+    }
+    else if(self->javaobject != NULL)
         (*penv)->DeleteGlobalRef(penv, self->javaobject);
+    if(self->scope != NULL)
+        scope_forget(self);
 
-    self->ob_type->tp_free(self);
+    /* The type's reference is released by the caller, subtype_dealloc() */
+    if(INSTANCE_FREELIST_OK(Py_TYPE(self)))
+        freelist_free(&javainstance_freelist, v_self);
+    else
+        self->ob_type->tp_free(self);
 }
 
 PyTypeObject JavaInstance_type = {
@@ -540,10 +1290,11 @@ PyTypeObject JavaInstance_type = {
     PyObject_HashNotImplemented, /*tp_hash */
     0,                         /*tp_call*/
     0,                         /*tp_str*/
-    JavaInstance_getattr,      /*tp_getattro*/
-    JavaInstance_setattr,      /*tp_setattro*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    Py_TPFLAGS_DEFAULT |
+      Py_TPFLAGS_BASETYPE,     /*tp_flags*/
     "Java object wrapper",     /*tp_doc*/
     0,                         /*tp_traverse*/
     0,                         /*tp_clear*/
@@ -561,164 +1312,472 @@ PyTypeObject JavaInstance_type = {
     0,                         /*tp_dictoffset*/
     0,                         /*tp_init*/
     0,                         /*tp_alloc*/
-    PyType_GenericNew,         /*tp_new*/
+    0,                         /*tp_new*/
 };
 
 
 /*==============================================================================
- * JavaClass type.
+ * MethodDescriptor and FieldDescriptor types.
  *
- * This is the wrapper returned by getclass().
- * It can be called to make a new instance of that Java type, or accessed for
- * either static fields or unbound methods (static or not).
+ * These are put in the dict of the type generated for each Java class, so
+ * that getting a member is a regular Python attribute lookup.
+ * A MethodDescriptor gives an UnboundMethod when read from the class, and a
+ * BoundMethod when read from an instance. A FieldDescriptor reads a static
+ * field from the class, or reads and writes a nonstatic field through an
+ * instance; static fields are written by JavaClass_setattr().
  */
 
-extern PyTypeObject JavaClass_type;
+static int set_instance_field(ClassInfo *info, java_Field *field,
+        PyObject *name, PyObject *obj, PyObject *value)
+{
+    int res;
 
-typedef struct _S_JavaClass {
-    PyObject_HEAD
-    jobject javaclass;
-    java_Methods *constructors;
-} JavaClass;
+    if(value == NULL)
+    {
+        PyErr_Format(
+                PyExc_AttributeError,
+                "Java attribute %s can't be deleted",
+                PyString_AS_STRING(name));
+        return -1;
+    }
 
-static PyObject *JavaClass_new(PyTypeObject *type,
-        PyObject *args, PyObject *kwds)
-{
-    if(PySequence_Length(args) != 0)
+    if(!instance_check((JavaInstance*)obj))
+        return -1;
+    if(!java_push_frame(FRAME_REFS(1)))
     {
-        PyErr_SetString(
-                PyExc_NotImplementedError,
-                "Subclassing Java classes is not supported");
-        return NULL;
+        PyErr_NoMemory();
+        return -1;
+    }
+    res = convert_setjavafield(
+            info->javaclass, ((JavaInstance*)obj)->javaobject,
+            field, FIELD_NONSTATIC, value);
+    java_pop_frame(NULL);
+    if(res == 1)
+        return 0;
+    else if(res == -2)
+        return -1;
+    else
+    {
+        if(res == 0)
+            PyErr_Format(
+                    Err_FieldTypeError,
+                    "Java nonstatic attribute %s has incompatible type",
+                    PyString_AS_STRING(name));
+        else /* res == -1 */
+            PyErr_Format(
+                    PyExc_AttributeError,
+                    "Java class has no nonstatic attribute %s",
+                    PyString_AS_STRING(name));
+        return -1;
     }
-    return type->tp_alloc(type, 0);
 }
 
-static PyObject *JavaClass_create(PyObject *v_self,
-        PyObject *args, PyObject *kwargs)
-{
-    JavaClass *self = (JavaClass*)v_self;
-    jobject javaobject;
-    size_t nbargs;
-    size_t nonmatches;
-    size_t i;
+typedef struct _S_MethodDescriptor {
+    PyObject_HEAD
+    ClassInfo *info;
+    java_Methods *overloads;
+    java_Field *field; /* field with the same name, or NULL */
+    PyObject *name;
+} MethodDescriptor;
 
-    java_Method *matching_method;
+static PyObject *MethodDescriptor_get(PyObject *v_self,
+        PyObject *obj, PyObject *type)
+{
+    MethodDescriptor *self = (MethodDescriptor*)v_self;
 
-    if(self->constructors == NULL)
+    if(obj == NULL)
+    {
+        /* The methods of Class, read from Class itself, are bound to it like
+         * those of any other class object */
+        if((*penv)->IsSameObject(penv, self->info->javaclass, class_Class))
+            return classmethod_new(class_Class, self->overloads, FIELD_BOTH,
+                                   self->name);
+        return unboundmethod_new(self->info->javaclass, self->overloads,
+                                 self->name);
+    }
+    else if(!PyObject_TypeCheck(obj, &JavaInstance_type))
     {
         PyErr_SetString(
-                Err_NoMatchingOverload,
-                "no visible constructor");
+                PyExc_TypeError,
+                "Java methods can only be bound to Java objects");
         return NULL;
     }
+    if(!instance_check((JavaInstance*)obj))
+        return NULL;
+    return boundmethod_new(self->info, obj, self->overloads, self->name);
+}
 
-    matching_method = find_matching_overload(self->constructors,
-            args, &nonmatches, FIELD_STATIC);
-
-    nbargs = PyTuple_Size(args);
+static int MethodDescriptor_set(PyObject *v_self,
+        PyObject *obj, PyObject *value)
+{
+    MethodDescriptor *self = (MethodDescriptor*)v_self;
 
-    if(matching_method == NULL)
+    if(self->field == NULL)
     {
         PyErr_Format(
-                Err_NoMatchingOverload,
-                "%zu constructors with %zd parameters (no match)",
-                nonmatches, nbargs);
-        return NULL;
+                PyExc_AttributeError,
+                "Java method %s can't be assigned",
+                PyString_AS_STRING(self->name));
+        return -1;
     }
+    return set_instance_field(self->info, self->field, self->name,
+                              obj, value);
+}
 
-    {
-        jvalue *java_parameters;
-        java_parameters = malloc(sizeof(jvalue) * nbargs);
-        for(i = 0; i < nbargs; ++i)
-            convert_py2jav(
-                    PyTuple_GET_ITEM(args, i),
-                    matching_method->args[i],
-                    &java_parameters[i]);
-
-        javaobject = (*penv)->NewObjectA(
-                penv,
-                self->javaclass, matching_method->id,
-                java_parameters);
+static void MethodDescriptor_dealloc(PyObject *v_self)
+{
+    MethodDescriptor *self = (MethodDescriptor*)v_self;
 
-        free(java_parameters);
-    }
+    if(self->overloads != NULL)
+        java_decref_methods(self->overloads);
+    Py_XDECREF(self->name);
 
-    {
-        JavaInstance *inst = (JavaInstance*)PyObject_CallObject(
-                (PyObject*)&JavaInstance_type,
-                NULL);
-        inst->javaobject = (*penv)->NewGlobalRef(penv, javaobject);
-        return (PyObject*)inst;
-    }
+    self->ob_type->tp_free(self);
 }
 
-static PyObject *JavaClass_getattr(PyObject *v_self, PyObject *attr_name)
+static PyTypeObject MethodDescriptor_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.MethodDescriptor", /*tp_name*/
+    sizeof(MethodDescriptor),  /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    MethodDescriptor_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Java method descriptor",  /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    0,                         /*tp_methods*/
+    0,                         /*tp_members*/
+    0,                         /*tp_getset*/
+    0,                         /*tp_base*/
+    0,                         /*tp_dict*/
+    MethodDescriptor_get,      /*tp_descr_get*/
+    MethodDescriptor_set,      /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    0,                         /*tp_new*/
+};
+
+typedef struct _S_FieldDescriptor {
+    PyObject_HEAD
+    ClassInfo *info;
+    java_Field *field;
+    PyObject *name;
+} FieldDescriptor;
+
+static PyObject *FieldDescriptor_get(PyObject *v_self,
+        PyObject *obj, PyObject *type)
 {
-    JavaClass *self = (JavaClass*)v_self;
-    Py_ssize_t namelen;
-    const char *name = PyString_AsString(attr_name); /* UTF-8 */
-    if(name == NULL)
-        return NULL; /* TypeError from PyString_AsString() */
-    namelen = PyString_GET_SIZE(attr_name);
+    FieldDescriptor *self = (FieldDescriptor*)v_self;
+    PyObject *value;
 
-    /* First, try to find a method with that name, in that class.
-     * If at least one such method exists, we return an UnboundMethod. */
-    if(!(*penv)->IsSameObject(penv, self->javaclass, class_Class))
+    if(obj == NULL)
     {
-        java_Methods *methods = java_list_methods(self->javaclass, name,
-                                                  FIELD_BOTH);
-        if(methods != NULL)
-        {
-            UnboundMethod *wrapper = PyObject_NewVar(UnboundMethod,
-                    &UnboundMethod_type, namelen);
-            wrapper->javaclass = (*penv)->NewGlobalRef(penv, self->javaclass);
-            wrapper->overloads = methods;
-            memcpy(wrapper->name, name, namelen);
-            wrapper->name[namelen] = '\0';
-
-            return (PyObject*)wrapper;
-        }
+        if(!java_push_frame(FRAME_REFS(0)))
+            return PyErr_NoMemory();
+        value = convert_getjavafield(self->info->javaclass, NULL,
+                                     self->field, FIELD_STATIC);
+        java_pop_frame(NULL);
+        if(value == NULL && !PyErr_Occurred())
+            PyErr_Format(
+                    PyExc_AttributeError,
+                    "Java class has no static attribute %s",
+                    PyString_AS_STRING(self->name));
     }
-
-    /* Then, try a field (static) */
+    else if(!PyObject_TypeCheck(obj, &JavaInstance_type))
     {
-        PyObject *field = convert_getjavafield(self->javaclass, NULL, name,
-                                               FIELD_STATIC);
-        if(field != NULL)
-            return field;
+        PyErr_SetString(
+                PyExc_TypeError,
+                "Java fields can only be read from Java objects");
+        return NULL;
     }
-
-    /* Finally, act on the Class object (reflection) */
+    else
     {
-        /* If calling from Class, we can access all methods; if calling on
-         * another Class instance, don't access the static methods */
-        int list_what = (*penv)->IsSameObject(penv, class_Class,
-                                              self->javaclass)?
-                FIELD_BOTH:FIELD_NONSTATIC;
-        java_Methods *methods = java_list_methods(class_Class, name,
-                                                  list_what);
-        if(methods != NULL)
-        {
-            /* A different kind of wrapper is used here because we need a
-             * non-static Class method to be bound to javaclass but a static
-             * Class method not to be (obviously, it's static). */
-            ClassMethod *wrapper = PyObject_NewVar(ClassMethod,
-                    &ClassMethod_type, namelen);
-            wrapper->javaclass = (*penv)->NewGlobalRef(penv, self->javaclass);
-            wrapper->overloads = methods;
-            memcpy(wrapper->name, name, namelen);
-            wrapper->name[namelen] = '\0';
-
-            return (PyObject*)wrapper;
-        }
+        if(!instance_check((JavaInstance*)obj))
+            return NULL;
+        if(!java_push_frame(FRAME_REFS(0)))
+            return PyErr_NoMemory();
+        value = convert_getjavafield(self->info->javaclass,
+                                     ((JavaInstance*)obj)->javaobject,
+                                     self->field, FIELD_NONSTATIC);
+        java_pop_frame(NULL);
+        if(value == NULL && !PyErr_Occurred())
+            PyErr_Format(
+                    PyExc_AttributeError,
+                    "Java instance has no nonstatic attribute %s",
+                    PyString_AS_STRING(self->name));
+    }
+    return value;
+}
+
+static int FieldDescriptor_set(PyObject *v_self,
+        PyObject *obj, PyObject *value)
+{
+    FieldDescriptor *self = (FieldDescriptor*)v_self;
+
+    return set_instance_field(self->info, self->field, self->name,
+                              obj, value);
+}
+
+static void FieldDescriptor_dealloc(PyObject *v_self)
+{
+    FieldDescriptor *self = (FieldDescriptor*)v_self;
+
+    Py_XDECREF(self->name);
+
+    self->ob_type->tp_free(self);
+}
+
+static PyTypeObject FieldDescriptor_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.FieldDescriptor",  /*tp_name*/
+    sizeof(FieldDescriptor),   /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    FieldDescriptor_dealloc,   /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Java field descriptor",   /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    0,                         /*tp_methods*/
+    0,                         /*tp_members*/
+    0,                         /*tp_getset*/
+    0,                         /*tp_base*/
+    0,                         /*tp_dict*/
+    FieldDescriptor_get,       /*tp_descr_get*/
+    FieldDescriptor_set,       /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    0,                         /*tp_new*/
+};
+
+
+/*==============================================================================
+ * JavaClass type.
+ *
+ * This is the metaclass of the types generated for Java classes, which are
+ * returned by getclass().
+ * Each Java class gets a Python type, derived from the types of its superclass
+ * and interfaces (or from JavaInstance), whose dict holds descriptors for its
+ * methods and fields. Calling it makes a new instance of that Java type;
+ * attributes that are not members of the class act on the Class object.
+ */
+
+typedef struct _S_JavaClass {
+    PyHeapTypeObject type;
+    jobject javaclass;
+    java_Methods *constructors;
+    ClassInfo *info;
+    /* Whether all the superclasses and interfaces are Python bases; if so,
+     * the MRO is enough to answer isinstance() and issubclass() */
+    char exact;
+    /* The type of the elements for array classes, CVT_J_VOID otherwise */
+    enum CVT_JType component;
+    /* How the elements of arrays of objects are converted */
+    enum JAVA_ResultKind component_kind;
+} JavaClass;
+
+static ClassInfo *classinfo_Class = NULL;
+
+static PyObject *JavaClass_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    if(PySequence_Length(args) != 0)
+        PyErr_SetString(
+                PyExc_NotImplementedError,
+                "Subclassing Java classes is not supported");
+    else
+        PyErr_SetString(
+                PyExc_TypeError,
+                "JavaClass objects are obtained through getclass()");
+    return NULL;
+}
+
+static PyObject *JavaClass_create(PyObject *v_self,
+        PyObject *args, PyObject *kwargs)
+{
+    JavaClass *self = (JavaClass*)v_self;
+    jobject javaobject;
+    size_t nbargs;
+    size_t nonmatches;
+    size_t i;
+
+    java_Method *matching_method;
+
+    if(self->constructors == NULL)
+    {
+        PyErr_SetString(
+                Err_NoMatchingOverload,
+                "no visible constructor");
+        return NULL;
+    }
+
+    matching_method = find_matching_overload(self->constructors,
+            args, 0, &nonmatches, FIELD_STATIC);
+
+    nbargs = PyTuple_Size(args);
+
+    if(matching_method == NULL)
+    {
+        PyErr_Format(
+                Err_NoMatchingOverload,
+                "%zu constructors with %zd parameters (no match)",
+                nonmatches, nbargs);
+        return NULL;
+    }
+
+    if(!java_push_frame(FRAME_REFS(nbargs)))
+        return PyErr_NoMemory();
+    {
+        jvalue *java_parameters;
+        java_parameters = malloc(sizeof(jvalue) * nbargs);
+        for(i = 0; i < nbargs; ++i)
+        {
+            if(!convert_py2jav(
+                    PyTuple_GET_ITEM(args, i),
+                    matching_method->argtypes[i],
+                    matching_method->args[i],
+                    &java_parameters[i]))
+                break;
+        }
+
+        if(i < nbargs)
+        {
+            /* Only the parameters before i have been converted */
+            while(i-- > 0)
+                convert_py2jav_release(
+                        PyTuple_GET_ITEM(args, i),
+                        matching_method->argtypes[i],
+                        &java_parameters[i]);
+            free(java_parameters);
+            java_pop_frame(NULL);
+            return NULL;
+        }
+
+        if(convert_release_gil)
+        {
+            Py_BEGIN_ALLOW_THREADS
+            javaobject = (*penv)->NewObjectA(
+                    penv,
+                    self->javaclass, matching_method->id,
+                    java_parameters);
+            Py_END_ALLOW_THREADS
+        }
+        else
+            javaobject = (*penv)->NewObjectA(
+                    penv,
+                    self->javaclass, matching_method->id,
+                    java_parameters);
+
+        for(i = 0; i < nbargs; ++i)
+            convert_py2jav_release(
+                    PyTuple_GET_ITEM(args, i),
+                    matching_method->argtypes[i],
+                    &java_parameters[i]);
+
+        free(java_parameters);
+    }
+
+    if((*penv)->ExceptionCheck(penv))
+    {
+        convert_java_exception();
+        java_pop_frame(NULL);
+        return NULL;
+    }
+
+    {
+        PyObject *inst = javainstance_new((PyTypeObject*)v_self, javaobject);
+        /* A new object can't be in the identity map yet, but it might come
+         * back from Java later */
+        if(inst != NULL && identity_enabled)
+            identity_insert((JavaInstance*)inst,
+                            java_identity_hash(javaobject));
+        java_pop_frame(NULL);
+        return inst;
+    }
+}
+
+static PyObject *JavaClass_getattr(PyObject *v_self, PyObject *attr_name)
+{
+    JavaClass *self = (JavaClass*)v_self;
+    java_Methods *methods;
+
+    /* First, look in the type: its dict holds the members of the Java class,
+     * and Python's own attributes of types are there too */
+    {
+        PyObject *attr = PyType_Type.tp_getattro(v_self, attr_name);
+        if(attr != NULL || !PyErr_ExceptionMatches(PyExc_AttributeError))
+            return attr;
+        PyErr_Clear();
+    }
+    if(!PyString_Check(attr_name))
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "attribute name must be a string");
+        return NULL;
+    }
+
+    /* Then, act on the Class object (reflection); if the class is Class, its
+     * methods have already been found in its dict */
+    if(!java_push_frame(FRAME_REFS(0)))
+        return PyErr_NoMemory();
+    if(classinfo_Class == NULL)
+        classinfo_Class = classinfo_get(class_Class);
+    methods = classinfo_get_methods(classinfo_Class, attr_name,
+                                    FIELD_NONSTATIC);
+    java_pop_frame(NULL);
+    if(methods != NULL)
+    {
+        /* A different kind of wrapper is used here because we need a
+         * non-static Class method to be bound to javaclass */
+        return classmethod_new(self->javaclass, methods, FIELD_NONSTATIC,
+                               attr_name);
     }
 
     /* We didn't find anything, raise AttributeError */
     PyErr_Format(
             PyExc_AttributeError,
             "Java class has no attribute %s",
-            name);
+            PyString_AS_STRING(attr_name));
     return NULL;
 }
 
@@ -731,10 +1790,33 @@ static int JavaClass_setattr(PyObject *v_self, PyObject *attr_name,
     if(name == NULL)
         return -1; /* TypeError from PyString_AsString() */
 
-    res = convert_setjavafield(self->javaclass, NULL, name,
-                               FIELD_STATIC, value);
+    /* Special attributes are those of the Python type */
+    if(name[0] == '_' && name[1] == '_')
+        return PyType_Type.tp_setattro(v_self, attr_name, value);
+
+    if(value == NULL)
+    {
+        PyErr_Format(
+                PyExc_AttributeError,
+                "Java attribute %s can't be deleted",
+                name);
+        return -1;
+    }
+
+    if(!java_push_frame(FRAME_REFS(1)))
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    res = convert_setjavafield(
+            self->javaclass, NULL,
+            classinfo_get_field(self->info, attr_name),
+            FIELD_STATIC, value);
+    java_pop_frame(NULL);
     if(res == 1)
         return 0;
+    else if(res == -2)
+        return -1;
     else
     {
         if(res == 0)
@@ -751,96 +1833,916 @@ static int JavaClass_setattr(PyObject *v_self, PyObject *attr_name,
     }
 }
 
-static void JavaClass_dealloc(PyObject *v_self)
+static void JavaClass_dealloc(PyObject *v_self)
+{
+    JavaClass *self = (JavaClass*)v_self;
+
+    if(self->constructors != NULL)
+        java_decref_methods(self->constructors);
+    if(self->javaclass != NULL)
+    {
+        (*penv)->DeleteGlobalRef(penv, self->javaclass);
+        self->javaclass = NULL;
+    }
+
+    PyType_Type.tp_dealloc(v_self);
+}
+
+static PyObject *JavaClass_subclasscheck(JavaClass *self, PyObject *args)
+{
+    PyObject *obj;
+    JavaClass *other;
+    if(!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
+
+    if(!PyObject_TypeCheck(obj, &JavaClass_type))
+    {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+    other = (JavaClass*)obj;
+
+    /* The generated types mirror the Java hierarchy, so this is usually
+     * answered by Python alone */
+    if(PyType_IsSubtype((PyTypeObject*)other, (PyTypeObject*)self)
+     || (!other->exact
+      && classinfo_is_subclass(other->info, self->javaclass)))
+    {
+        Py_INCREF(Py_True);
+        return Py_True;
+    }
+    else
+    {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+}
+
+static PyObject *JavaClass_instancecheck(JavaClass *self, PyObject *args)
+{
+    PyObject *obj;
+    JavaClass *objtype;
+    if(!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
+
+    if(!PyObject_TypeCheck(obj, &JavaInstance_type))
+    {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+    objtype = (JavaClass*)Py_TYPE(obj);
+
+    if(PyType_IsSubtype((PyTypeObject*)objtype, (PyTypeObject*)self)
+     || (!objtype->exact
+      && classinfo_is_subclass(objtype->info, self->javaclass)))
+    {
+        Py_INCREF(Py_True);
+        return Py_True;
+    }
+    else
+    {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+}
+
+static PyMethodDef JavaClass_methods[] = {
+    {"__subclasscheck__", (PyCFunction)JavaClass_subclasscheck, METH_VARARGS,
+    "__subclasscheck__(obj) -> bool"
+    },
+    {"__instancecheck__", (PyCFunction)JavaClass_instancecheck, METH_VARARGS,
+    "__instancecheck__(obj) -> bool"
+    },
+    {NULL}  /* Sentinel */
+};
+
+PyTypeObject JavaClass_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.JavaClass",        /*tp_name*/
+    sizeof(JavaClass),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    JavaClass_dealloc,         /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    JavaClass_create,          /*tp_call*/
+    0,                         /*tp_str*/
+    JavaClass_getattr,         /*tp_getattro*/
+    JavaClass_setattr,         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Java class wrapper",      /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    JavaClass_methods,         /*tp_methods*/
+    0,                         /*tp_members*/
+    0,                         /*tp_getset*/
+    0,                         /*tp_base*/
+    0,                         /*tp_dict*/
+    0,                         /*tp_descr_get*/
+    0,                         /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    JavaClass_new,             /*tp_new*/
+};
+
+
+/*==============================================================================
+ * JavaArray type.
+ *
+ * This is a base of the types generated for Java array classes.
+ *
+ * Arrays of a primitive type implement the buffer protocol. The elements are
+ * pinned with Get<Type>ArrayElements() when a buffer is requested and released
+ * (and copied back, if the JVM gave a copy) with the last buffer. Using the
+ * array as a context manager keeps them pinned for the whole block instead;
+ * commit() copies the changes back to Java without unpinning.
+ */
+
+typedef struct _S_JavaArray {
+    JavaInstance base;
+    void *elements; /* pinned elements, or NULL */
+    Py_ssize_t length;
+    size_t exports; /* buffers currently exported */
+    size_t holds; /* with blocks currently entered */
+} JavaArray;
+
+/* Buffer format and item size for each primitive type */
+static const struct {
+    char *format;
+    Py_ssize_t itemsize;
+} array_formats[NB_JPTYPES] = {
+    {NULL, 0},                  /* void */
+    {"?", sizeof(jboolean)},
+    {"b", sizeof(jbyte)},
+    {"H", sizeof(jchar)},
+    {"h", sizeof(jshort)},
+    {"i", sizeof(jint)},
+    {"q", sizeof(jlong)},
+    {"f", sizeof(jfloat)},
+    {"d", sizeof(jdouble)}
+};
+
+static enum CVT_JType array_component(JavaArray *self)
+{
+    return ((JavaClass*)Py_TYPE(self))->component;
+}
+
+static int JavaArray_pin(JavaArray *self)
+{
+    enum CVT_JType type = array_component(self);
+    if(self->elements != NULL)
+        return 1;
+    if(type == CVT_J_OBJECT)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "Only arrays of a primitive type support the buffer "
+                "protocol");
+        return 0;
+    }
+    if(!instance_check(&self->base))
+        return 0;
+    self->length = (*penv)->GetArrayLength(penv, self->base.javaobject);
+    self->elements = java_get_array_elements(self->base.javaobject, type);
+    if(self->elements == NULL)
+    {
+        PyErr_NoMemory();
+        return 0;
+    }
+    return 1;
+}
+
+static void JavaArray_unpin(JavaArray *self, jint mode)
+{
+    java_release_array_elements(self->base.javaobject, array_component(self),
+                                self->elements, mode);
+    self->elements = NULL;
+}
+
+static int JavaArray_getbuffer(PyObject *v_self, Py_buffer *view, int flags)
+{
+    JavaArray *self = (JavaArray*)v_self;
+    Py_ssize_t itemsize;
+
+    if(!JavaArray_pin(self))
+    {
+        view->obj = NULL;
+        return -1;
+    }
+    itemsize = array_formats[array_component(self)].itemsize;
+
+    view->buf = self->elements;
+    view->obj = v_self;
+    Py_INCREF(v_self);
+    view->len = self->length * itemsize;
+    view->readonly = 0;
+    view->itemsize = itemsize;
+    view->format = NULL;
+    if(flags & PyBUF_FORMAT)
+        view->format = array_formats[array_component(self)].format;
+    view->ndim = 1;
+    view->shape = NULL;
+    if(flags & PyBUF_ND)
+    {
+        view->smalltable[0] = self->length;
+        view->shape = &view->smalltable[0];
+    }
+    view->strides = NULL;
+    if((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+    {
+        view->smalltable[1] = itemsize;
+        view->strides = &view->smalltable[1];
+    }
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    self->exports++;
+    return 0;
+}
+
+static void JavaArray_releasebuffer(PyObject *v_self, Py_buffer *view)
+{
+    JavaArray *self = (JavaArray*)v_self;
+
+    if(--self->exports == 0 && self->holds == 0)
+        JavaArray_unpin(self, 0);
+}
+
+static PyObject *JavaArray_enter(JavaArray *self)
+{
+    if(!JavaArray_pin(self))
+        return NULL;
+    self->holds++;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject *JavaArray_exit(JavaArray *self, PyObject *args)
+{
+    PyObject *exc_type, *exc_value, *traceback;
+    if(!PyArg_ParseTuple(args, "OOO", &exc_type, &exc_value, &traceback))
+        return NULL;
+
+    if(self->holds == 0)
+    {
+        PyErr_SetString(
+                PyExc_RuntimeError,
+                "__exit__() called without __enter__()");
+        return NULL;
+    }
+    if(--self->holds == 0 && self->exports == 0)
+    {
+        /* Changes made in a block that raised are dropped, unless they were
+         * already committed */
+        JavaArray_unpin(self, (exc_type == Py_None)?0:JNI_ABORT);
+    }
+    else if(self->holds == 0)
+    {
+        /* Buffers are still exported; copy back now, the elements will be
+         * released with the last of them */
+        if(exc_type == Py_None)
+            java_release_array_elements(self->base.javaobject,
+                                        array_component(self),
+                                        self->elements, JNI_COMMIT);
+    }
+
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+static PyObject *JavaArray_commit(JavaArray *self)
+{
+    if(self->elements != NULL)
+        java_release_array_elements(self->base.javaobject,
+                                    array_component(self),
+                                    self->elements, JNI_COMMIT);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static void JavaArray_dealloc(PyObject *v_self)
+{
+    JavaArray *self = (JavaArray*)v_self;
+
+    /* Can't be exported, buffers hold a reference; this is a with block that
+     * was never exited */
+    if(self->elements != NULL)
+        JavaArray_unpin(self, 0);
+
+    JavaInstance_dealloc(v_self);
+}
+
+/*
+ * Arrays of objects implement the sequence protocol. Elements are converted
+ * like the return values of methods; ranges of them (slices, iteration,
+ * tolist()) are converted by chunks, each in its own local frame.
+ */
+
+#define ARRAY_CHUNK 64
+
+static Py_ssize_t JavaArray_length(PyObject *v_self)
+{
+    JavaArray *self = (JavaArray*)v_self;
+    if(!instance_check(&self->base))
+        return -1;
+    return (*penv)->GetArrayLength(penv, self->base.javaobject);
+}
+
+static int array_check_objects(JavaArray *self)
+{
+    if(array_component(self) != CVT_J_OBJECT)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "Arrays of a primitive type are accessed through the buffer "
+                "protocol, e.g. memoryview()");
+        return 0;
+    }
+    return instance_check(&self->base);
+}
+
+/**
+ * Converts a range of elements of an array of objects.
+ *
+ * The array is checked again here: iterators call this after they were
+ * created, and the scope of the array might have exited since.
+ *
+ * @return A new list of count elements.
+ */
+static PyObject *array_get_elements(JavaArray *self,
+        Py_ssize_t start, Py_ssize_t step, Py_ssize_t count)
+{
+    enum JAVA_ResultKind kind = ((JavaClass*)Py_TYPE(self))->component_kind;
+    PyObject *list;
+    Py_ssize_t i = 0;
+
+    if(!instance_check(&self->base))
+        return NULL;
+    list = PyList_New(count);
+    if(list == NULL)
+        return NULL;
+    while(i < count)
+    {
+        Py_ssize_t end = (count - i > ARRAY_CHUNK)?(i + ARRAY_CHUNK):count;
+        if(!java_push_frame(FRAME_REFS(ARRAY_CHUNK)))
+        {
+            Py_DECREF(list);
+            return PyErr_NoMemory();
+        }
+        for(; i < end; ++i)
+        {
+            jobject element = (*penv)->GetObjectArrayElement(
+                    penv,
+                    self->base.javaobject, start + i * step);
+            PyObject *item = convert_jobject_result(element, kind);
+            if(item == NULL)
+            {
+                java_pop_frame(NULL);
+                Py_DECREF(list);
+                return NULL;
+            }
+            PyList_SET_ITEM(list, i, item);
+        }
+        java_pop_frame(NULL);
+    }
+    return list;
+}
+
+static PyObject *JavaArray_item(PyObject *v_self, Py_ssize_t i)
+{
+    JavaArray *self = (JavaArray*)v_self;
+    jobject element;
+    PyObject *item;
+
+    if(!array_check_objects(self))
+        return NULL;
+    if(i < 0 || i >= JavaArray_length(v_self))
+    {
+        PyErr_SetString(
+                PyExc_IndexError,
+                "array index out of range");
+        return NULL;
+    }
+    if(!java_push_frame(FRAME_REFS(0)))
+        return PyErr_NoMemory();
+    element = (*penv)->GetObjectArrayElement(
+            penv,
+            self->base.javaobject, i);
+    item = convert_jobject_result(
+            element,
+            ((JavaClass*)Py_TYPE(self))->component_kind);
+    java_pop_frame(NULL);
+    return item;
+}
+
+static PyObject *JavaArray_subscript(PyObject *v_self, PyObject *item)
+{
+    JavaArray *self = (JavaArray*)v_self;
+
+    if(!array_check_objects(self))
+        return NULL;
+    if(PyIndex_Check(item))
+    {
+        Py_ssize_t i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if(i == -1 && PyErr_Occurred())
+            return NULL;
+        if(i < 0)
+            i += JavaArray_length(v_self);
+        return JavaArray_item(v_self, i);
+    }
+    else if(PySlice_Check(item))
+    {
+        Py_ssize_t start, stop, step, slicelength;
+        if(PySlice_GetIndicesEx((PySliceObject*)item,
+                                JavaArray_length(v_self),
+                                &start, &stop, &step, &slicelength) < 0)
+            return NULL;
+        return array_get_elements(self, start, step, slicelength);
+    }
+    else
+    {
+        PyErr_Format(
+                PyExc_TypeError,
+                "array indices must be integers, not %.200s",
+                Py_TYPE(item)->tp_name);
+        return NULL;
+    }
+}
+
+static PyObject *JavaArray_tolist(JavaArray *self)
+{
+    if(!array_check_objects(self))
+        return NULL;
+    return array_get_elements(self, 0, 1,
+                              JavaArray_length((PyObject*)self));
+}
+
+/**
+ * Iterator over an array of objects, converting ARRAY_CHUNK elements at a
+ * time.
+ */
+typedef struct _S_JavaArrayIter {
+    PyObject_HEAD
+    JavaArray *array;
+    Py_ssize_t index; /* next element to be converted */
+    Py_ssize_t length;
+    PyObject *chunk; /* list of converted elements, or NULL */
+    Py_ssize_t chunk_pos; /* next element to be returned from chunk */
+} JavaArrayIter;
+
+static PyObject *JavaArrayIter_next(PyObject *v_self)
+{
+    JavaArrayIter *self = (JavaArrayIter*)v_self;
+    PyObject *item;
+
+    if(self->chunk == NULL || self->chunk_pos == PyList_GET_SIZE(self->chunk))
+    {
+        Py_ssize_t count = self->length - self->index;
+        if(count <= 0)
+            return NULL;
+        if(count > ARRAY_CHUNK)
+            count = ARRAY_CHUNK;
+        Py_XDECREF(self->chunk);
+        self->chunk = array_get_elements(self->array, self->index, 1, count);
+        if(self->chunk == NULL)
+            return NULL;
+        self->index += count;
+        self->chunk_pos = 0;
+    }
+    item = PyList_GET_ITEM(self->chunk, self->chunk_pos++);
+    Py_INCREF(item);
+    return item;
+}
+
+static void JavaArrayIter_dealloc(PyObject *v_self)
+{
+    JavaArrayIter *self = (JavaArrayIter*)v_self;
+    Py_DECREF(self->array);
+    Py_XDECREF(self->chunk);
+    self->ob_type->tp_free(self);
+}
+
+static PyTypeObject JavaArrayIter_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.JavaArrayIterator", /*tp_name*/
+    sizeof(JavaArrayIter),     /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    JavaArrayIter_dealloc,     /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Java array iterator",     /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    PyObject_SelfIter,         /*tp_iter*/
+    JavaArrayIter_next,        /*tp_iternext*/
+};
+
+static PyObject *JavaArray_iter(PyObject *v_self)
+{
+    JavaArray *self = (JavaArray*)v_self;
+    JavaArrayIter *iter;
+
+    if(!array_check_objects(self))
+        return NULL;
+    iter = PyObject_New(JavaArrayIter, &JavaArrayIter_type);
+    if(iter == NULL)
+        return NULL;
+    Py_INCREF(self);
+    iter->array = self;
+    iter->index = 0;
+    iter->length = JavaArray_length(v_self);
+    iter->chunk = NULL;
+    iter->chunk_pos = 0;
+    return (PyObject*)iter;
+}
+
+static PySequenceMethods JavaArray_as_sequence = {
+    JavaArray_length,          /*sq_length*/
+    0,                         /*sq_concat*/
+    0,                         /*sq_repeat*/
+    JavaArray_item,            /*sq_item*/
+};
+
+static PyMappingMethods JavaArray_as_mapping = {
+    JavaArray_length,          /*mp_length*/
+    JavaArray_subscript,       /*mp_subscript*/
+    0,                         /*mp_ass_subscript*/
+};
+
+static PyBufferProcs JavaArray_as_buffer = {
+    0,                         /*bf_getreadbuffer*/
+    0,                         /*bf_getwritebuffer*/
+    0,                         /*bf_getsegcount*/
+    0,                         /*bf_getcharbuffer*/
+    JavaArray_getbuffer,       /*bf_getbuffer*/
+    JavaArray_releasebuffer,   /*bf_releasebuffer*/
+};
+
+static PyMethodDef JavaArray_methods[] = {
+    {"__enter__", (PyCFunction)JavaArray_enter, METH_NOARGS,
+    "Pins the elements until __exit__()."
+    },
+    {"__exit__", (PyCFunction)JavaArray_exit, METH_VARARGS,
+    "Copies the changes back to Java (unless an exception was raised) and "
+    "releases the elements."
+    },
+    {"commit", (PyCFunction)JavaArray_commit, METH_NOARGS,
+    "Copies the changes made through buffers back to the Java array."
+    },
+    {"tolist", (PyCFunction)JavaArray_tolist, METH_NOARGS,
+    "Converts all the elements of an array of objects to a list."
+    },
+    {NULL}  /* Sentinel */
+};
+
+PyTypeObject JavaArray_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.JavaArray",        /*tp_name*/
+    sizeof(JavaArray),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    JavaArray_dealloc,         /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &JavaArray_as_sequence,    /*tp_as_sequence*/
+    &JavaArray_as_mapping,     /*tp_as_mapping*/
+    PyObject_HashNotImplemented, /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &JavaArray_as_buffer,      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+      Py_TPFLAGS_BASETYPE |
+      Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Java array wrapper",      /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    JavaArray_iter,            /*tp_iter*/
+    0,                         /*tp_iternext*/
+    JavaArray_methods,         /*tp_methods*/
+    0,                         /*tp_members*/
+    0,                         /*tp_getset*/
+    &JavaInstance_type,        /*tp_base*/
+    0,                         /*tp_dict*/
+    0,                         /*tp_descr_get*/
+    0,                         /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    0,                         /*tp_new*/
+};
+
+
+/*==============================================================================
+ * JavaByteBuffer type.
+ *
+ * This is a base of the type generated for java.nio.ByteBuffer, so that
+ * direct buffers implement the buffer protocol: the memory of the ByteBuffer
+ * (its whole capacity) is exposed as it is, and the wrapper keeps the
+ * ByteBuffer alive while it is exported. Other ByteBuffers raise BufferError.
+ */
+
+static int JavaByteBuffer_getbuffer(PyObject *v_self, Py_buffer *view,
+        int flags)
+{
+    jobject javabuffer = ((JavaInstance*)v_self)->javaobject;
+    void *address;
+    jlong capacity;
+    int readonly;
+
+    if(!instance_check((JavaInstance*)v_self))
+    {
+        view->obj = NULL;
+        return -1;
+    }
+    address = (*penv)->GetDirectBufferAddress(penv, javabuffer);
+
+    if(address == NULL)
+    {
+        PyErr_SetString(
+                PyExc_BufferError,
+                "ByteBuffer is not direct");
+        view->obj = NULL;
+        return -1;
+    }
+    capacity = (*penv)->GetDirectBufferCapacity(penv, javabuffer);
+    readonly = (*penv)->CallBooleanMethod(
+            penv,
+            javabuffer, meth_Buffer_isReadOnly) != JNI_FALSE;
+    return PyBuffer_FillInfo(view, v_self, address, capacity, readonly,
+                             flags);
+}
+
+static PyBufferProcs JavaByteBuffer_as_buffer = {
+    0,                         /*bf_getreadbuffer*/
+    0,                         /*bf_getwritebuffer*/
+    0,                         /*bf_getsegcount*/
+    0,                         /*bf_getcharbuffer*/
+    JavaByteBuffer_getbuffer,  /*bf_getbuffer*/
+    0,                         /*bf_releasebuffer*/
+};
+
+PyTypeObject JavaByteBuffer_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.JavaByteBuffer",   /*tp_name*/
+    sizeof(JavaInstance),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    0,                         /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    PyObject_HashNotImplemented, /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &JavaByteBuffer_as_buffer, /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+      Py_TPFLAGS_BASETYPE |
+      Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Java direct ByteBuffer wrapper", /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    0,                         /*tp_methods*/
+    0,                         /*tp_members*/
+    0,                         /*tp_getset*/
+    &JavaInstance_type,        /*tp_base*/
+    0,                         /*tp_dict*/
+    0,                         /*tp_descr_get*/
+    0,                         /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    0,                         /*tp_new*/
+};
+
+
+/*==============================================================================
+ * Scope type.
+ *
+ * A context manager that releases the Java objects wrapped while it is active
+ * when it exits, instead of waiting for their wrappers to be collected. The
+ * wrappers that are still around become invalid, unless they were kept with
+ * keep(). Arrays with pinned elements are kept too, since their buffers are
+ * still in use.
+ *
+ * In local mode, the wrappers hold local references instead of global ones,
+ * in a flat frame that the scope pops when it exits (see
+ * java_push_flat_frame()); the other local references created in the scope
+ * are only freed then.
+ */
+
+/* Initial capacity of the frame of a local scope */
+#define SCOPE_FRAME_REFS 256
+
+static unsigned long scope_released = 0;
+
+static PyObject *Scope_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"local", NULL};
+    Scope *self;
+    PyObject *local = Py_False;
+    int truth;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &local))
+        return NULL;
+    truth = PyObject_IsTrue(local);
+    if(truth == -1)
+        return NULL;
+
+    self = (Scope*)type->tp_alloc(type, 0);
+    self->local = truth;
+    self->active = 0;
+    self->instances = NULL;
+    self->nb_instances = 0;
+    self->size = 0;
+    self->parent = NULL;
+    return (PyObject*)self;
+}
+
+static PyObject *Scope_enter(Scope *self)
 {
-    JavaClass *self = (JavaClass*)v_self;
-
-    if(self->constructors != NULL)
-        java_free_methods(self->constructors);
-    if(self->javaclass != NULL)
+    if(self->active)
     {
-        (*penv)->DeleteGlobalRef(penv, self->javaclass);
-        self->javaclass = NULL;
+        PyErr_SetString(
+                PyExc_RuntimeError,
+                "scope is already active");
+        return NULL;
     }
-
-    self->ob_type->tp_free(self);
+    if(self->local && !java_push_flat_frame(SCOPE_FRAME_REFS))
+        return PyErr_NoMemory();
+
+    /* The chain of active scopes holds a reference on them */
+    Py_INCREF(self);
+    self->active = 1;
+    self->env = penv;
+    self->parent = current_scope;
+    current_scope = self;
+
+    Py_INCREF(self);
+    return (PyObject*)self;
 }
 
-static PyObject *JavaClass_subclasscheck(JavaClass *self, PyObject *args)
+static PyObject *Scope_exit(Scope *self, PyObject *args)
 {
-    PyObject *obj;
-    JavaClass *other;
-    if(!PyArg_ParseTuple(args, "O", &obj))
-        return NULL;
+    size_t i;
 
-    if(!PyObject_IsInstance(obj, (PyObject*)&JavaClass_type))
+    if(current_scope != self)
     {
-        Py_INCREF(Py_False);
-        return Py_False;
+        PyErr_SetString(
+                PyExc_RuntimeError,
+                "__exit__() called on a scope that isn't the innermost one");
+        return NULL;
     }
-    other = (JavaClass*)obj;
 
-    if(java_is_subclass(other->javaclass, self->javaclass))
+    for(i = 0; i < self->nb_instances; ++i)
     {
-        Py_INCREF(Py_True);
-        return Py_True;
-    }
-    else
-    {
-        Py_INCREF(Py_False);
-        return Py_False;
+        JavaInstance *inst = self->instances[i];
+        if(inst == NULL)
+            continue;
+        inst->scope = NULL;
+        if(PyObject_TypeCheck(inst, &JavaArray_type) &&
+                ((JavaArray*)inst)->elements != NULL)
+        {
+            instance_promote(inst);
+            continue;
+        }
+        if(inst->identity_mapped)
+            identity_remove(inst);
+        /* Local references go away with the frame */
+        if(!inst->local_ref)
+            (*penv)->DeleteGlobalRef(penv, inst->javaobject);
+        inst->javaobject = NULL;
+        scope_released++;
     }
+    free(self->instances);
+    self->instances = NULL;
+    self->nb_instances = self->size = 0;
+
+    if(self->local)
+        java_pop_frame(NULL);
+    current_scope = self->parent;
+    self->parent = NULL;
+    self->active = 0;
+    Py_DECREF(self);
+
+    Py_INCREF(Py_False);
+    return Py_False;
 }
 
-static PyObject *JavaClass_instancecheck(JavaClass *self, PyObject *args)
+static PyObject *Scope_keep(Scope *self, PyObject *args)
 {
     PyObject *obj;
     JavaInstance *inst;
-    jclass instclass;
-    int res;
     if(!PyArg_ParseTuple(args, "O", &obj))
         return NULL;
 
-    if(!PyObject_IsInstance(obj, (PyObject*)&JavaInstance_type))
+    if(!PyObject_TypeCheck(obj, &JavaInstance_type))
     {
-        Py_INCREF(Py_False);
-        return Py_False;
+        PyErr_SetString(
+                PyExc_TypeError,
+                "keep() takes a Java object");
+        return NULL;
     }
     inst = (JavaInstance*)obj;
-
-    instclass = java_getclass(inst->javaobject);
-    res = java_is_subclass(instclass, self->javaclass);
-    (*penv)->DeleteLocalRef(penv, instclass);
-
-    if(res)
+    if(inst->scope != self)
     {
-        Py_INCREF(Py_True);
-        return Py_True;
+        PyErr_SetString(
+                PyExc_ValueError,
+                "object wasn't created in this scope");
+        return NULL;
     }
-    else
+    if(self->env != java_thread_env)
     {
-        Py_INCREF(Py_False);
-        return Py_False;
+        PyErr_SetString(
+                PyExc_RuntimeError,
+                "keep() called from another thread");
+        return NULL;
     }
+
+    scope_forget(inst);
+    instance_promote(inst);
+
+    Py_INCREF(obj);
+    return obj;
 }
 
-static PyMethodDef JavaClass_methods[] = {
-    {"__subclasscheck__", (PyCFunction)JavaClass_subclasscheck, METH_VARARGS,
-    "__subclasscheck__(obj) -> bool"
+static PyMethodDef Scope_methods[] = {
+    {"__enter__", (PyCFunction)Scope_enter, METH_NOARGS,
+    "Records the Java objects wrapped from now on."
     },
-    {"__instancecheck__", (PyCFunction)JavaClass_instancecheck, METH_VARARGS,
-    "__instancecheck__(obj) -> bool"
+    {"__exit__", (PyCFunction)Scope_exit, METH_VARARGS,
+    "Releases the Java objects recorded, except those that were kept."
+    },
+    {"keep", (PyCFunction)Scope_keep, METH_VARARGS,
+    "keep(obj) -> obj\n"
+    "\n"
+    "Keeps a Java object created in this scope valid after it exits."
     },
     {NULL}  /* Sentinel */
 };
 
-PyTypeObject JavaClass_type = {
+static void Scope_dealloc(PyObject *v_self)
+{
+    /* Active scopes are referenced by the chain, so this one isn't */
+    Scope *self = (Scope*)v_self;
+    free(self->instances);
+    self->ob_type->tp_free(self);
+}
+
+PyTypeObject Scope_type = {
     PyObject_HEAD_INIT(NULL)
     0,                         /*ob_size*/
-    "pyjava.JavaClass",        /*tp_name*/
-    sizeof(JavaClass),         /*tp_basicsize*/
+    "pyjava.scope",            /*tp_name*/
+    sizeof(Scope),             /*tp_basicsize*/
     0,                         /*tp_itemsize*/
-    JavaClass_dealloc,         /*tp_dealloc*/
+    Scope_dealloc,             /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
     0,                         /*tp_setattr*/
@@ -849,22 +2751,25 @@ PyTypeObject JavaClass_type = {
     0,                         /*tp_as_number*/
     0,                         /*tp_as_sequence*/
     0,                         /*tp_as_mapping*/
-    PyObject_HashNotImplemented, /*tp_hash */
-    JavaClass_create,          /*tp_call*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
     0,                         /*tp_str*/
-    JavaClass_getattr,         /*tp_getattro*/
-    JavaClass_setattr,         /*tp_setattro*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT |
-      Py_TPFLAGS_BASETYPE,     /*tp_flags*/
-    "Java class wrapper",      /*tp_doc*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "scope(local=False)\n"
+    "\n"
+    "Context manager releasing the Java objects wrapped in the block when it\n"
+    "exits. With local=True, the wrappers hold local references, which are\n"
+    "cheaper but only freed when the block exits.", /*tp_doc*/
     0,                         /*tp_traverse*/
     0,                         /*tp_clear*/
-    javawrapper_compare,       /*tp_richcompare*/
+    0,                         /*tp_richcompare*/
     0,                         /*tp_weaklistoffset*/
     0,                         /*tp_iter*/
     0,                         /*tp_iternext*/
-    JavaClass_methods,         /*tp_methods*/
+    Scope_methods,             /*tp_methods*/
     0,                         /*tp_members*/
     0,                         /*tp_getset*/
     0,                         /*tp_base*/
@@ -874,31 +2779,308 @@ PyTypeObject JavaClass_type = {
     0,                         /*tp_dictoffset*/
     0,                         /*tp_init*/
     0,                         /*tp_alloc*/
-    JavaClass_new,             /*tp_new*/
+    Scope_new,                 /*tp_new*/
 };
 
 
 /*==============================================================================
- * JavaClass and JavaInstance comparison
+ * inout type.
+ *
+ * Marks a buffer passed for an array parameter: the Java array that is created
+ * from it gets copied back into the buffer after the call, so that Java can
+ * use it as an output parameter (see convert_py2jav_release()).
  */
 
-static int get_compared_object(PyObject *o, jobject *j)
+typedef struct _S_InOut {
+    PyObject_HEAD
+    PyObject *buffer;
+} InOut;
+
+static PyObject *InOut_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    InOut *self;
+    PyObject *buffer;
+    if(!PyArg_ParseTuple(args, "O", &buffer))
+        return NULL;
+    if(!PyObject_CheckBuffer(buffer))
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "inout() takes an object supporting the buffer protocol");
+        return NULL;
+    }
+
+    self = (InOut*)type->tp_alloc(type, 0);
+    Py_INCREF(buffer);
+    self->buffer = buffer;
+    return (PyObject*)self;
+}
+
+static void InOut_dealloc(PyObject *v_self)
 {
-    int check;
+    InOut *self = (InOut*)v_self;
+    Py_DECREF(self->buffer);
+    self->ob_type->tp_free(self);
+}
 
-    check = PyObject_IsInstance(o, (PyObject*)&JavaInstance_type);
-    if(check == -1)
-        return -1;
-    else if(check)
+PyTypeObject InOut_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyjava.inout",            /*tp_name*/
+    sizeof(InOut),             /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    InOut_dealloc,             /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "inout(buffer)\n"
+    "\n"
+    "Passes a buffer as a Java array parameter, and copies the array back\n"
+    "into it after the call.", /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    0,                         /*tp_methods*/
+    0,                         /*tp_members*/
+    0,                         /*tp_getset*/
+    0,                         /*tp_base*/
+    0,                         /*tp_dict*/
+    0,                         /*tp_descr_get*/
+    0,                         /*tp_descr_set*/
+    0,                         /*tp_dictoffset*/
+    0,                         /*tp_init*/
+    0,                         /*tp_alloc*/
+    InOut_new,                 /*tp_new*/
+};
+
+
+static PyTypeObject *get_class_type(ClassInfo *info);
+
+/**
+ * Appends the type of a Java class to a list of bases.
+ *
+ * @returns The 'exact' flag of that type.
+ */
+static int add_base(PyObject *bases, jclass javaclass)
+{
+    PyTypeObject *type = get_class_type(classinfo_get(javaclass));
+    if(type == NULL)
     {
-        *j = ((JavaInstance*)o)->javaobject;
-        return 1;
+        PyErr_Clear();
+        return 0;
     }
+    if(!PySequence_Contains(bases, (PyObject*)type))
+        PyList_Append(bases, (PyObject*)type);
+    return ((JavaClass*)type)->exact;
+}
 
-    check = PyObject_IsInstance(o, (PyObject*)&JavaClass_type);
-    if(check == -1)
-        return -1;
-    else if(check)
+static PyObject *make_class_type(ClassInfo *info, PyObject *bases,
+        PyObject *dict)
+{
+    PyObject *type;
+    PyObject *args;
+    size_t namelen;
+    char *classname = (char*)java_getclassname(info->javaclass, &namelen);
+    const char *dot = (classname[0] != '[')?strrchr(classname, '.'):NULL;
+    PyObject *tuple = PyList_AsTuple(bases);
+
+    /* The type is named after the class, in a module named after the package,
+     * e.g. <class 'java.lang.String'> */
+    if(dot != NULL)
+    {
+        PyObject *module = PyString_FromStringAndSize(classname,
+                                                      dot - classname);
+        PyDict_SetItemString(dict, "__module__", module);
+        Py_DECREF(module);
+        dot++;
+    }
+    else
+    {
+        PyDict_SetItemString(dict, "__module__", Py_None);
+        dot = classname;
+    }
+    args = Py_BuildValue("(sOO)", dot, tuple, dict);
+    free(classname);
+    Py_DECREF(tuple);
+
+    type = PyType_Type.tp_new(&JavaClass_type, args, NULL);
+    Py_DECREF(args);
+    return type;
+}
+
+static PyTypeObject *build_class_type(ClassInfo *info)
+{
+    PyObject *dict;
+    PyObject *bases;
+    JavaClass *type;
+    jclass component;
+    int exact = 1;
+
+    /* The dict of the type holds a descriptor for each member */
+    classinfo_load(info);
+    dict = PyDict_New();
+    {
+        Py_ssize_t pos = 0;
+        PyObject *name, *entry;
+        while(PyDict_Next(info->methods, &pos, &name, &entry))
+        {
+            MethodDescriptor *descr;
+            if(entry == Py_None)
+                continue;
+            descr = PyObject_New(MethodDescriptor, &MethodDescriptor_type);
+            descr->info = info;
+            descr->overloads = PyCObject_AsVoidPtr(entry);
+            java_incref_methods(descr->overloads);
+            descr->field = classinfo_get_field(info, name);
+            Py_INCREF(name);
+            descr->name = name;
+            PyDict_SetItem(dict, name, (PyObject*)descr);
+            Py_DECREF(descr);
+        }
+        pos = 0;
+        while(PyDict_Next(info->fields, &pos, &name, &entry))
+        {
+            FieldDescriptor *descr;
+            if(entry == Py_None || PyDict_GetItem(dict, name) != NULL)
+                continue;
+            descr = PyObject_New(FieldDescriptor, &FieldDescriptor_type);
+            descr->info = info;
+            descr->field = PyCObject_AsVoidPtr(entry);
+            Py_INCREF(name);
+            descr->name = name;
+            PyDict_SetItem(dict, name, (PyObject*)descr);
+            Py_DECREF(descr);
+        }
+    }
+    /* Instances only hold the jobject */
+    {
+        PyObject *slots = PyTuple_New(0);
+        PyDict_SetItemString(dict, "__slots__", slots);
+        Py_DECREF(slots);
+    }
+
+    /* The bases are the types of the superclass and the interfaces */
+    bases = PyList_New(0);
+    component = java_get_component_type(info->javaclass);
+    if(component != NULL)
+    {
+        /* Arrays also get the methods of JavaArray; it comes first so it is
+         * kept if the other bases have to be dropped */
+        PyList_Append(bases, (PyObject*)&JavaArray_type);
+    }
+    else if((*penv)->IsSameObject(penv, info->javaclass, class_ByteBuffer))
+    {
+        /* Likewise, ByteBuffer and its subclasses get JavaByteBuffer */
+        PyList_Append(bases, (PyObject*)&JavaByteBuffer_type);
+    }
+    {
+        jclass superclass = java_get_superclass(info->javaclass);
+        jobjectArray interfaces = java_get_interfaces(info->javaclass);
+        size_t nb_interfaces = (*penv)->GetArrayLength(penv, interfaces);
+        size_t i;
+
+        if(superclass != NULL)
+        {
+            exact &= add_base(bases, superclass);
+            (*penv)->DeleteLocalRef(penv, superclass);
+        }
+        for(i = 0; i < nb_interfaces; ++i)
+        {
+            jclass interface = (*penv)->GetObjectArrayElement(
+                    penv,
+                    interfaces, i);
+            exact &= add_base(bases, interface);
+            (*penv)->DeleteLocalRef(penv, interface);
+        }
+        (*penv)->DeleteLocalRef(penv, interfaces);
+    }
+    if(PyList_GET_SIZE(bases) == 0)
+        PyList_Append(bases, (PyObject*)&JavaInstance_type);
+
+    type = (JavaClass*)make_class_type(info, bases, dict);
+    if(type == NULL && PyList_GET_SIZE(bases) > 1)
+    {
+        /* Python can't always order the interfaces in a consistent MRO; keep
+         * only the first base, isinstance() will then ask Java */
+        PyErr_Clear();
+        PyList_SetSlice(bases, 1, PyList_GET_SIZE(bases), NULL);
+        exact = 0;
+        type = (JavaClass*)make_class_type(info, bases, dict);
+    }
+    Py_DECREF(bases);
+    Py_DECREF(dict);
+    if(type == NULL)
+    {
+        if(component != NULL)
+            (*penv)->DeleteLocalRef(penv, component);
+        return NULL;
+    }
+
+    type->javaclass = (*penv)->NewGlobalRef(penv, info->javaclass);
+    type->constructors = java_list_constructors(info->javaclass);
+    type->info = info;
+    type->exact = exact;
+    if(component != NULL)
+    {
+        type->component = java_id_type(component);
+        type->component_kind = java_result_kind(component);
+        (*penv)->DeleteLocalRef(penv, component);
+    }
+    else
+        type->component = CVT_J_VOID;
+
+    /* The record keeps the type alive forever */
+    info->pytype = (PyObject*)type;
+    return (PyTypeObject*)type;
+}
+
+static PyTypeObject *get_class_type(ClassInfo *info)
+{
+    PyTypeObject *type;
+
+    if(info->pytype != NULL)
+        return (PyTypeObject*)info->pytype;
+
+    if(!java_push_frame(CLASS_FRAME_REFS))
+    {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    type = build_class_type(info);
+    java_pop_frame(NULL);
+    return type;
+}
+
+
+/*==============================================================================
+ * JavaClass and JavaInstance comparison
+ */
+
+static int get_compared_object(PyObject *o, jobject *j)
+{
+    if(PyObject_TypeCheck(o, &JavaInstance_type))
+    {
+        JavaInstance *inst = (JavaInstance*)o;
+        *j = inst->javaobject;
+        return *j != NULL && (!inst->local_ref || instance_on_thread(inst));
+    }
+    else if(PyObject_TypeCheck(o, &JavaClass_type))
     {
         *j = ((JavaClass*)o)->javaclass;
         return 1;
@@ -927,11 +3109,7 @@ PyObject *javawrapper_compare(PyObject *o1, PyObject *o2, int op)
         int cv1, cv2;
 
         cv1 = get_compared_object(o1, &inst1);
-        if(cv1 == -1)
-            return NULL;
         cv2 = get_compared_object(o2, &inst2);
-        if(cv2 == -1)
-            return NULL;
 
         if(!cv1 || !cv2)
         {
@@ -969,11 +3147,40 @@ void javawrapper_init(PyObject *mod)
     Py_INCREF(&JavaInstance_type);
     PyModule_AddObject(mod, "JavaInstance", (PyObject*)&JavaInstance_type);
 
+    if(PyType_Ready(&JavaArray_type) < 0)
+        return;
+    Py_INCREF(&JavaArray_type);
+    PyModule_AddObject(mod, "JavaArray", (PyObject*)&JavaArray_type);
+    if(PyType_Ready(&JavaArrayIter_type) < 0)
+        return;
+
+    if(PyType_Ready(&JavaByteBuffer_type) < 0)
+        return;
+    Py_INCREF(&JavaByteBuffer_type);
+    PyModule_AddObject(mod, "JavaByteBuffer",
+                       (PyObject*)&JavaByteBuffer_type);
+
+    if(PyType_Ready(&InOut_type) < 0)
+        return;
+    Py_INCREF(&InOut_type);
+    PyModule_AddObject(mod, "inout", (PyObject*)&InOut_type);
+
+    if(PyType_Ready(&Scope_type) < 0)
+        return;
+    Py_INCREF(&Scope_type);
+    PyModule_AddObject(mod, "scope", (PyObject*)&Scope_type);
+
+    JavaClass_type.tp_base = &PyType_Type;
     if(PyType_Ready(&JavaClass_type) < 0)
         return;
     Py_INCREF(&JavaClass_type);
     PyModule_AddObject(mod, "JavaClass", (PyObject*)&JavaClass_type);
 
+    if(PyType_Ready(&MethodDescriptor_type) < 0)
+        return;
+    if(PyType_Ready(&FieldDescriptor_type) < 0)
+        return;
+
     if(PyType_Ready(&UnboundMethod_type) < 0)
         return;
     Py_INCREF(&UnboundMethod_type);
@@ -988,60 +3195,109 @@ void javawrapper_init(PyObject *mod)
         return;
     Py_INCREF(&ClassMethod_type);
     PyModule_AddObject(mod, "ClassMethod", (PyObject*)&ClassMethod_type);
+
+    if(PyType_Ready(&MethodHandle_type) < 0)
+        return;
+    Py_INCREF(&MethodHandle_type);
+    PyModule_AddObject(mod, "MethodHandle", (PyObject*)&MethodHandle_type);
 }
 
 PyObject *javawrapper_wrap_class(jclass javaclass)
 {
-    JavaClass *wrapper;
-    PyObject *cstr_args = Py_BuildValue("()");
-
-    wrapper = (JavaClass*)PyObject_CallObject((PyObject*)&JavaClass_type,
-                                              cstr_args);
-    Py_DECREF(cstr_args);
-
-    wrapper->javaclass = (*penv)->NewGlobalRef(penv, javaclass);
-    wrapper->constructors = java_list_constructors(javaclass);
-
-    return (PyObject*)wrapper;
+    PyObject *type = (PyObject*)get_class_type(classinfo_get(javaclass));
+    Py_XINCREF(type);
+    return type;
 }
 
 int javawrapper_unwrap_instance(PyObject *pyobject,
-        jobject *javaobject, jclass *javaclass)
+        jobject *javaobject, ClassInfo **info)
 {
-    if(PyObject_IsInstance(pyobject, (PyObject*)&JavaInstance_type))
+    if(PyObject_TypeCheck(pyobject, &JavaInstance_type))
     {
         JavaInstance *inst = (JavaInstance*)pyobject;
+        /* Released by its scope, or not usable from this thread */
+        if(inst->javaobject == NULL ||
+                (inst->local_ref && !instance_on_thread(inst)))
+            return 0;
         if(javaobject != NULL)
             *javaobject = inst->javaobject;
-        if(javaclass != NULL)
-            *javaclass = java_getclass(inst->javaobject);
+        /* Java objects are always instances of their class's type */
+        if(info != NULL)
+            *info = ((JavaClass*)Py_TYPE(pyobject))->info;
         return 1;
     }
-    else if(PyObject_IsInstance(pyobject, (PyObject*)&JavaClass_type))
+    else if(PyObject_TypeCheck(pyobject, &JavaClass_type))
     {
         JavaClass *cls = (JavaClass*)pyobject;
         if(javaobject != NULL)
             *javaobject = cls->javaclass;
-        if(javaclass != NULL)
-            *javaclass = class_Class;
+        if(info != NULL)
+        {
+            if(classinfo_Class == NULL)
+                classinfo_Class = classinfo_get(class_Class);
+            *info = classinfo_Class;
+        }
         return 1;
     }
     return 0;
 }
 
+PyObject *javawrapper_unwrap_inout(PyObject *pyobject)
+{
+    if(Py_TYPE(pyobject) == &InOut_type)
+        return ((InOut*)pyobject)->buffer;
+    return NULL;
+}
+
 PyObject *javawrapper_wrap_instance(jobject javaobject)
 {
-    jclass javaclass = java_getclass(javaobject);
-    if(java_equals(javaclass, class_Class))
-        return javawrapper_wrap_class(javaobject);
+    PyObject *result;
+    jclass javaclass;
+    jint hash = 0;
+
+    if(identity_enabled)
+    {
+        JavaInstance *inst;
+        hash = java_identity_hash(javaobject);
+        inst = identity_lookup(javaobject, hash);
+        if(inst != NULL)
+        {
+            identity_cache_hits++;
+            Py_INCREF(inst);
+            return (PyObject*)inst;
+        }
+    }
+
+    javaclass = java_getclass(javaobject);
+    if((*penv)->IsSameObject(penv, javaclass, class_Class))
+        result = javawrapper_wrap_class(javaobject);
     else
     {
-        PyObject *cstr_args = Py_BuildValue("()");
-        JavaInstance *inst = (JavaInstance*)PyObject_CallObject(
-                (PyObject*)&JavaInstance_type,
-                cstr_args);
-        Py_DECREF(cstr_args);
-        inst->javaobject = (*penv)->NewGlobalRef(penv, javaobject);
-        return (PyObject*)inst;
+        PyTypeObject *type = get_class_type(classinfo_get(javaclass));
+        if(type == NULL)
+            result = NULL;
+        else
+        {
+            result = javainstance_new(type, javaobject);
+            if(result != NULL && identity_enabled)
+            {
+                identity_cache_misses++;
+                identity_insert((JavaInstance*)result, hash);
+            }
+        }
     }
+    (*penv)->DeleteLocalRef(penv, javaclass);
+    return result;
+}
+
+void javawrapper_stats(PyObject *dict)
+{
+    pyjava_add_counter(dict, "overload_cache_hits", overload_cache_hits);
+    pyjava_add_counter(dict, "overload_cache_misses", overload_cache_misses);
+    pyjava_add_counter(dict, "freelist_hits", freelist_hits);
+    pyjava_add_counter(dict, "freelist_misses", freelist_misses);
+    pyjava_add_counter(dict, "identity_cache_hits", identity_cache_hits);
+    pyjava_add_counter(dict, "identity_cache_misses", identity_cache_misses);
+    pyjava_add_counter(dict, "identity_cache_size", identity_size);
+    pyjava_add_counter(dict, "scope_released", scope_released);
 }
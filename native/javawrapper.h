@@ -4,6 +4,8 @@
 #include <Python.h>
 #include <jni.h>
 
+#include "classinfo.h"
+
 
 /**
  * Initialize the module (creates the types).
@@ -20,13 +22,24 @@ PyObject *javawrapper_wrap_class(jclass javaclass);
 /**
  * Unwraps a JavaInstance object.
  *
+ * This doesn't call Java: the class of the object is known from its type.
+ *
  * @param javaobject Where to store the Java object, or NULL.
- * @param javaclass Where to store the Java class, or NULL.
+ * @param info Where to store the metadata record of the object's class, or
+ * NULL.
  * @returns 1 on success, 0 on error (for instance, pyobj wasn't a JavaInstance
  * Python object).
  */
 int javawrapper_unwrap_instance(PyObject *pyobject,
-        jobject *javaobject, jclass *javaclass);
+        jobject *javaobject, ClassInfo **info);
+
+
+/**
+ * Returns the object wrapped by an inout() marker, or NULL.
+ *
+ * The reference is borrowed.
+ */
+PyObject *javawrapper_unwrap_inout(PyObject *pyobject);
 
 
 /**
@@ -34,4 +47,25 @@ int javawrapper_unwrap_instance(PyObject *pyobject,
  */
 PyObject *javawrapper_wrap_instance(jobject javaobject);
 
+
+/**
+ * Enables or disables the identity map.
+ *
+ * While it is enabled, wrapping a Java object that already has a live wrapper
+ * returns that same wrapper, so that identity is preserved ('is' works) and no
+ * new global reference is created. It costs a call to
+ * System.identityHashCode() each time an object is wrapped.
+ *
+ * @returns Whether it was enabled before.
+ */
+int javawrapper_set_identity_cache(int enabled);
+
+
+/**
+ * Adds the statistics of this module to a dictionary.
+ *
+ * Used by _pyjava.stats().
+ */
+void javawrapper_stats(PyObject *dict);
+
 #endif
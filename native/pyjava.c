@@ -1,5 +1,6 @@
 #include "pyjava.h"
 
+#include "classinfo.h"
 #include "convert.h"
 #include "java.h"
 #include "javawrapper.h"
@@ -9,6 +10,11 @@ PyObject *Err_Base;
 PyObject *Err_ClassNotFound;
 PyObject *Err_NoMatchingOverload;
 PyObject *Err_FieldTypeError;
+PyObject *Err_JavaException;
+PyObject *Err_Interrupted;
+
+/* The classes already returned by getclass(), by JNI name */
+static PyObject *classes_by_name = NULL;
 
 /**
  * _pyjava.start function: dynamically load a JVM DLL and start it.
@@ -20,11 +26,12 @@ static PyObject *pyjava_start(PyObject *self, PyObject *args)
     size_t size;
     const char **option_array;
     size_t i;
+    int started;
 
     if(!(PyArg_ParseTuple(args, "sO!", &path, &PyList_Type, &options)))
         return NULL;
 
-    if(penv != NULL)
+    if(java_vm != NULL)
     {
         PyErr_SetString(
                 Err_Base,
@@ -49,17 +56,18 @@ static PyObject *pyjava_start(PyObject *self, PyObject *args)
         option_array[i] = PyString_AS_STRING(option);
     }
 
-    penv = java_start_vm(path, option_array, size);
+    started = java_start_vm(path, option_array, size);
     free(option_array);
 
-    if(penv != NULL)
+    if(started)
     {
         /*
          * Initialize the modules dependent on the JVM (load classes and
          * methods, ...)
          */
         java_init();
-        convert_init();
+        classinfo_init();
+        classes_by_name = PyDict_New();
 
         Py_INCREF(Py_True);
         return Py_True;
@@ -77,12 +85,13 @@ static PyObject *pyjava_start(PyObject *self, PyObject *args)
 static PyObject *pyjava_getclass(PyObject *self, PyObject *args)
 {
     const char *classname;
+    PyObject *wrapper;
     jclass javaclass;
 
     if(!(PyArg_ParseTuple(args, "s", &classname)))
         return NULL;
 
-    if(penv == NULL)
+    if(java_vm == NULL)
     {
         PyErr_SetString(
                 Err_Base,
@@ -90,14 +99,123 @@ static PyObject *pyjava_getclass(PyObject *self, PyObject *args)
         return NULL;
     }
 
+    /* The wrappers are unique and never freed, so they can be kept */
+    wrapper = PyDict_GetItemString(classes_by_name, classname); /* borrowed */
+    if(wrapper != NULL)
+    {
+        Py_INCREF(wrapper);
+        return wrapper;
+    }
+
+    if(!java_push_frame(16))
+        return PyErr_NoMemory();
     javaclass = (*penv)->FindClass(penv, classname);
     if(javaclass == NULL)
     {
+        (*penv)->ExceptionClear(penv);
+        java_pop_frame(NULL);
         PyErr_SetString(Err_ClassNotFound, classname);
         return NULL;
     }
 
-    return javawrapper_wrap_class(javaclass);
+    wrapper = javawrapper_wrap_class(javaclass);
+    java_pop_frame(NULL);
+    if(wrapper != NULL)
+        PyDict_SetItemString(classes_by_name, classname, wrapper);
+    return wrapper;
+}
+
+/**
+ * _pyjava.bytebuffer function: share a Python buffer as a direct ByteBuffer.
+ */
+static PyObject *pyjava_bytebuffer(PyObject *self, PyObject *args)
+{
+    PyObject *buffer;
+    PyObject *wrapper;
+    jobject javabuffer;
+
+    if(!(PyArg_ParseTuple(args, "O", &buffer)))
+        return NULL;
+
+    if(java_vm == NULL)
+    {
+        PyErr_SetString(
+                Err_Base,
+                "Java VM is not running.");
+        return NULL;
+    }
+
+    if(!java_push_frame(16))
+        return PyErr_NoMemory();
+    javabuffer = convert_share_buffer(buffer);
+    if(javabuffer == NULL)
+        wrapper = NULL;
+    else
+        wrapper = javawrapper_wrap_instance(javabuffer);
+    java_pop_frame(NULL);
+    return wrapper;
+}
+
+/**
+ * _pyjava.identity_cache function: enable or disable the identity map.
+ */
+static PyObject *pyjava_identity_cache(PyObject *self, PyObject *args)
+{
+    PyObject *enabled;
+    int truth, previous;
+
+    if(!(PyArg_ParseTuple(args, "O", &enabled)))
+        return NULL;
+
+    truth = PyObject_IsTrue(enabled);
+    if(truth == -1)
+        return NULL;
+    previous = javawrapper_set_identity_cache(truth);
+    return PyBool_FromLong(previous);
+}
+
+/**
+ * _pyjava.release_gil function: whether to release the GIL during calls.
+ */
+static PyObject *pyjava_release_gil(PyObject *self, PyObject *args)
+{
+    PyObject *enabled;
+    int truth, previous;
+
+    if(!(PyArg_ParseTuple(args, "O", &enabled)))
+        return NULL;
+
+    truth = PyObject_IsTrue(enabled);
+    if(truth == -1)
+        return NULL;
+    previous = convert_release_gil;
+    convert_release_gil = truth;
+    return PyBool_FromLong(previous);
+}
+
+void pyjava_add_counter(PyObject *dict, const char *name,
+        unsigned long value)
+{
+    PyObject *pyvalue = PyLong_FromUnsignedLong(value);
+    PyDict_SetItemString(dict, name, pyvalue);
+    Py_DECREF(pyvalue);
+}
+
+/**
+ * _pyjava.stats function: get the counters of the caches.
+ */
+static PyObject *pyjava_stats(PyObject *self, PyObject *args)
+{
+    PyObject *dict = PyDict_New();
+    classinfo_stats(dict);
+    convert_stats(dict);
+    javawrapper_stats(dict);
+    pyjava_add_counter(dict, "local_frames", java_frame_stats.frames);
+    pyjava_add_counter(dict, "local_frames_depth_peak",
+                       java_frame_stats.depth_peak);
+    pyjava_add_counter(dict, "local_refs_peak", java_frame_stats.refs_peak);
+    pyjava_add_counter(dict, "threads_attached", java_threads_attached);
+    return dict;
 }
 
 static PyMethodDef methods[] = {
@@ -111,6 +229,30 @@ static PyMethodDef methods[] = {
     "getclass(str) -> JavaClass\n"
     "\n"
     "Find the desired class and returns a wrapper."},
+    {"bytebuffer",  pyjava_bytebuffer, METH_VARARGS,
+    "bytebuffer(buffer) -> java.nio.ByteBuffer\n"
+    "\n"
+    "Shares the memory of a writable buffer (e.g. a bytearray) with Java as\n"
+    "a direct ByteBuffer. The buffer stays in use until the ByteBuffer is\n"
+    "collected by the JVM; it is only released the next time a buffer is\n"
+    "shared or stats() is called, so a bytearray can't be resized before."},
+    {"identity_cache",  pyjava_identity_cache, METH_VARARGS,
+    "identity_cache(bool) -> bool\n"
+    "\n"
+    "Enables or disables the identity map: while it is enabled, a Java\n"
+    "object that already has a wrapper is returned as that same wrapper.\n"
+    "Returns whether it was enabled before."},
+    {"release_gil",  pyjava_release_gil, METH_VARARGS,
+    "release_gil(bool) -> bool\n"
+    "\n"
+    "Sets whether the GIL is released while Java methods and constructors\n"
+    "run, letting other Python threads run meanwhile; it is by default.\n"
+    "Returns the previous setting."},
+    {"stats",  pyjava_stats, METH_NOARGS,
+    "stats() -> dict\n"
+    "\n"
+    "Returns the counters of the internal caches, for instance the number\n"
+    "of overload resolutions that were found in the cache."},
     {NULL, NULL, 0, NULL}
 };
 
@@ -150,5 +292,15 @@ PyMODINIT_FUNC init_pyjava(void)
         Py_DECREF(bases);
     }
 
+    Err_JavaException = PyErr_NewException(
+            "pyjava.JavaException", Err_Base, NULL);
+    Py_INCREF(Err_JavaException);
+    PyModule_AddObject(mod, "JavaException", Err_JavaException);
+
+    Err_Interrupted = PyErr_NewException(
+            "pyjava.Interrupted", Err_JavaException, NULL);
+    Py_INCREF(Err_Interrupted);
+    PyModule_AddObject(mod, "Interrupted", Err_Interrupted);
+
     javawrapper_init(mod);
 }
@@ -1,12 +1,21 @@
-#ifndef PYJAVA_H
-#define PYJAVA_H
-
-#include <Python.h>
-
-
-extern PyObject *Err_Base;
-extern PyObject *Err_ClassNotFound;
-extern PyObject *Err_NoMatchingOverload;
-extern PyObject *Err_FieldTypeError;
-
-#endif
+#ifndef PYJAVA_H
+#define PYJAVA_H
+
+#include <Python.h>
+
+
+extern PyObject *Err_Base;
+extern PyObject *Err_ClassNotFound;
+extern PyObject *Err_NoMatchingOverload;
+extern PyObject *Err_FieldTypeError;
+extern PyObject *Err_JavaException;
+extern PyObject *Err_Interrupted;
+
+
+/**
+ * Adds a counter to the dictionary returned by _pyjava.stats().
+ */
+void pyjava_add_counter(PyObject *dict, const char *name,
+        unsigned long value);
+
+#endif
@@ -1,10 +1,19 @@
 import _pyjava
-from _pyjava import Error, ClassNotFound, NoMatchingOverload
+from _pyjava import Error, ClassNotFound, NoMatchingOverload, \
+    JavaException, Interrupted, \
+    bytebuffer, identity_cache, inout, release_gil, scope
+from pyjava import executor
+from pyjava.executor import CompletionError, java_future, set_pool_size, \
+    submit
+from pyjava.interrupt import TimeoutError, deadline
 
 
 __all__ = [
-        'Error', 'ClassNotFound', 'NoMatchingOverload',
-        'start', 'getclass']
+        'Error', 'ClassNotFound', 'NoMatchingOverload', 'JavaException',
+        'Interrupted', 'CompletionError', 'TimeoutError',
+        'start', 'getclass', 'bytebuffer', 'deadline', 'identity_cache',
+        'inout', 'java_future', 'release_gil', 'scope', 'set_pool_size',
+        'stats', 'submit']
 
 
 def start(path=None, *args):
@@ -22,9 +31,26 @@ def start(path=None, *args):
         raise Error("Unable to start Java VM with path %s" % path)
 
 
+_classes = {}
+
+
 def getclass(classname):
+    try:
+        return _classes[classname]
+    except KeyError:
+        pass
+
     # Convert from the 'usual' syntax to the 'JNI' syntax
     jni_classname = classname.replace('.', '/')
 
     cls = _pyjava.getclass(jni_classname)  # might raise ClassNotFound
+    _classes[classname] = cls
     return cls
+
+
+def stats():
+    """Returns the counters of the internal caches and of the worker pool.
+    """
+    counters = _pyjava.stats()
+    counters.update(executor.stats())
+    return counters
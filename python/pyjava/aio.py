@@ -0,0 +1,39 @@
+"""asyncio support.
+
+wrap_future() makes a Java CompletionStage (e.g. a CompletableFuture)
+awaitable from a coroutine.
+"""
+
+try:
+    import asyncio
+except ImportError:
+    import trollius as asyncio
+
+from pyjava.executor import java_future
+
+
+def wrap_future(stage, loop=None):
+    """Returns an asyncio Future that resolves with a Java CompletionStage.
+
+    The stage is waited on by another thread (see pyjava.java_future()), which
+    hands the result to the event loop with call_soon_threadsafe(); the loop
+    itself never blocks.
+    """
+    if loop is None:
+        loop = asyncio.get_event_loop()
+    aio_future = asyncio.Future(loop=loop)
+
+    def copy(future):
+        if aio_future.cancelled():
+            return
+        exception = future.exception()
+        if exception is not None:
+            aio_future.set_exception(exception)
+        else:
+            aio_future.set_result(future.result())
+
+    def done(future):
+        loop.call_soon_threadsafe(copy, future)
+
+    java_future(stage).add_done_callback(done)
+    return aio_future
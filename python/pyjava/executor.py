@@ -0,0 +1,221 @@
+"""Asynchronous Java calls.
+
+submit() runs a call on a fixed pool of worker threads. The workers are
+attached to the JVM the first time they call Java and stay attached for their
+whole life, and the GIL is released while they are in Java, so independent
+calls run in parallel without paying for attaching threads.
+"""
+
+import threading
+from concurrent.futures import Future
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+import _pyjava
+
+
+class _Pool(object):
+    """Fixed set of worker threads consuming a queue of calls.
+    """
+    def __init__(self, size):
+        self._queue = queue.Queue()
+        self._lock = threading.Lock()
+        self._workers = []
+        self.submitted = 0
+        self.completed = 0
+        self.resize(size)
+
+    def resize(self, size):
+        with self._lock:
+            while len(self._workers) < size:
+                worker = threading.Thread(target=self._run,
+                                          name='pyjava-worker')
+                worker.daemon = True
+                worker.start()
+                self._workers.append(worker)
+            # Extra workers exit when they get None
+            while len(self._workers) > size:
+                self._workers.pop()
+                self._queue.put(None)
+
+    def submit(self, fn, args, kwargs):
+        future = Future()
+        with self._lock:
+            self.submitted += 1
+        self._queue.put((future, fn, args, kwargs))
+        return future
+
+    def _run(self):
+        while True:
+            item = self._queue.get()
+            if item is None:
+                return
+            future, fn, args, kwargs = item
+            if future.set_running_or_notify_cancel():
+                try:
+                    result = fn(*args, **kwargs)
+                except BaseException as e:
+                    future.set_exception(e)
+                else:
+                    future.set_result(result)
+            with self._lock:
+                self.completed += 1
+
+    def stats(self):
+        return {'pool_workers': len(self._workers),
+                'pool_queue_depth': self._queue.qsize(),
+                'pool_submitted': self.submitted,
+                'pool_completed': self.completed}
+
+
+DEFAULT_POOL_SIZE = 4
+
+_pool = None
+_pool_lock = threading.Lock()
+
+
+def _get_pool():
+    global _pool
+    with _pool_lock:
+        if _pool is None:
+            _pool = _Pool(DEFAULT_POOL_SIZE)
+        return _pool
+
+
+def set_pool_size(size):
+    """Sets the number of worker threads used by submit().
+    """
+    if size < 1:
+        raise ValueError("pool needs at least one worker")
+    global _pool
+    with _pool_lock:
+        if _pool is None:
+            _pool = _Pool(size)
+        else:
+            _pool.resize(size)
+
+
+def submit(fn, *args, **kwargs):
+    """Calls fn(*args, **kwargs) on a worker thread, returning a Future.
+
+    fn is usually a Java method, e.g. submit(parser.parse, text); the result
+    is converted on the worker thread.
+    """
+    return _get_pool().submit(fn, args, kwargs)
+
+
+def stats():
+    """Returns the counters of the pool: number of workers, calls waiting in
+    the queue, calls submitted and calls completed.
+    """
+    if _pool is None:
+        return {'pool_workers': 0, 'pool_queue_depth': 0,
+                'pool_submitted': 0, 'pool_completed': 0}
+    return _pool.stats()
+
+
+class CompletionError(_pyjava.Error):
+    """A Java CompletionStage completed exceptionally.
+
+    The 'throwable' attribute is the Java exception.
+    """
+    def __init__(self, throwable):
+        _pyjava.Error.__init__(self, throwable.toString())
+        self.throwable = throwable
+
+
+class _Dispatcher(object):
+    """Single thread waiting for the stages passed to java_future().
+
+    Java interfaces can't be implemented from Python, so no callback can be
+    registered on the stages. Instead, this thread waits for any of them with
+    CompletableFuture.anyOf(), along with a 'wakeup' future that is completed
+    when a stage is added, then waits again on the new set.
+    """
+    def __init__(self):
+        self._CompletableFuture = _pyjava.getclass(
+                'java/util/concurrent/CompletableFuture')
+        self._Array = _pyjava.getclass('java/lang/reflect/Array')
+        self._lock = threading.Lock()
+        self._stages = []  # (completable, settled, future)
+        self._wakeup = self._CompletableFuture()
+        thread = threading.Thread(target=self._run, name='pyjava-futures')
+        thread.daemon = True
+        thread.start()
+
+    def add(self, completable, settled, future):
+        with self._lock:
+            self._stages.append((completable, settled, future))
+            wakeup = self._wakeup
+        wakeup.complete(None)
+
+    def _wait(self):
+        """Waits until the wakeup future or one of the stages completes.
+        """
+        with self._lock:
+            if self._wakeup.isDone():
+                self._wakeup = self._CompletableFuture()
+            futures = [self._wakeup] + [settled
+                                        for _, settled, _ in self._stages]
+        array = self._Array.newInstance(self._CompletableFuture, len(futures))
+        for i, f in enumerate(futures):
+            self._Array.set(array, i, f)
+        self._CompletableFuture.anyOf(array).get()
+
+    def _run(self):
+        while True:
+            try:
+                self._wait()
+            except _pyjava.Error:
+                pass  # e.g. a stage released by its scope, failed below
+            with self._lock:
+                stages, self._stages = self._stages, []
+                done = []
+                for entry in stages:
+                    try:
+                        finished = entry[1].isDone()
+                    except _pyjava.Error:
+                        finished = True
+                    if finished:
+                        done.append(entry)
+                    else:
+                        self._stages.append(entry)
+            for completable, settled, future in done:
+                try:
+                    value = settled.get()
+                    if completable.isCompletedExceptionally():
+                        future.set_exception(CompletionError(value))
+                    else:
+                        future.set_result(value)
+                except Exception as e:
+                    future.set_exception(e)
+
+
+_dispatcher = None
+_dispatcher_lock = threading.Lock()
+
+
+def java_future(stage):
+    """Returns a Future that resolves with a Java CompletionStage.
+
+    All the stages are waited for by a single thread rather than by the
+    workers, so pending stages don't hold up submit(), even if they depend on
+    it. The result is converted as usual; if the stage completes
+    exceptionally, the future gets a CompletionError.
+    """
+    global _dispatcher
+    Function = _pyjava.getclass('java/util/function/Function')
+    completable = stage.toCompletableFuture()
+    # Waiting on this one doesn't throw: exceptional completion gives the
+    # Throwable as its value
+    settled = completable.exceptionally(Function.identity())
+    future = Future()
+    future.set_running_or_notify_cancel()
+    with _dispatcher_lock:
+        if _dispatcher is None:
+            _dispatcher = _Dispatcher()
+    _dispatcher.add(completable, settled, future)
+    return future
@@ -0,0 +1,242 @@
+"""Deadlines for Java calls.
+
+A Java call can only be stopped from Java: a watchdog thread calls
+Thread.interrupt() on the Java thread running a deadline() block when the time
+is up, or when Ctrl-C is pressed. Methods that wait (sleep(), wait(),
+blocking queues, interruptible channels...) then throw, and the block raises
+TimeoutError or KeyboardInterrupt instead of the Java exception.
+
+Code that never checks for interruption still runs to completion, and the
+watchdog needs the GIL to be released during the call (see release_gil()).
+"""
+
+import errno
+import heapq
+import itertools
+import os
+import select
+import signal
+import sys
+import threading
+import time
+
+import _pyjava
+
+
+try:
+    _timeout_bases = (_pyjava.Error, TimeoutError)
+except NameError:  # Python 2
+    _timeout_bases = (_pyjava.Error,)
+
+TimeoutError = type('TimeoutError', _timeout_bases, {
+        '__module__': 'pyjava',
+        '__doc__': "A deadline() expired while Java was running."})
+
+
+# Ctrl-C can be watched through signal.set_wakeup_fd(), which needs pipes
+_use_pipes = os.name == 'posix'
+
+# Written to the wakeup pipe when a deadline is added; signals write their
+# number (Python 3) or a null byte (Python 2)
+_WAKE = ord('w')
+
+
+def _in_main_thread():
+    if hasattr(threading, 'main_thread'):
+        return threading.current_thread() is threading.main_thread()
+    return isinstance(threading.current_thread(), threading._MainThread)
+
+
+def _can_watch_sigint():
+    return (_use_pipes and _in_main_thread() and
+            signal.getsignal(signal.SIGINT) is signal.default_int_handler)
+
+
+def _is_sigint(byte):
+    if sys.version_info >= (3,):
+        return byte == signal.SIGINT
+    return byte != _WAKE
+
+
+def _set_nonblocking(fd):
+    import fcntl
+    flags = fcntl.fcntl(fd, fcntl.F_GETFL)
+    fcntl.fcntl(fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+
+
+class _Watchdog(object):
+    """Single thread interrupting the Java threads of expired deadlines.
+
+    It keeps a heap of (expiry, sequence, deadline) and sleeps until the first
+    expiry, or until its wakeup pipe is written to: either because a deadline
+    was added, or by Python's signal handler (see signal.set_wakeup_fd()).
+    Deadlines that end before they expire are only marked as done, and are
+    dropped from the heap when they come up.
+    """
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._heap = []
+        self._sequence = itertools.count()
+        self._sigint = []  # deadlines interrupted by Ctrl-C
+        if _use_pipes:
+            self.wakeup_fd_read, self.wakeup_fd = os.pipe()
+            _set_nonblocking(self.wakeup_fd_read)
+            _set_nonblocking(self.wakeup_fd)
+        else:
+            self._event = threading.Event()
+        thread = threading.Thread(target=self._run, name='pyjava-deadline')
+        thread.daemon = True
+        thread.start()
+
+    def add(self, dl):
+        with self._lock:
+            if dl._watch_sigint:
+                self._sigint.append(dl)
+            if dl.seconds is None:
+                return
+            heapq.heappush(self._heap, (dl._expiry, next(self._sequence), dl))
+            first = self._heap[0][2] is dl
+        # The watchdog only needs to wake up to sleep for less time
+        if first:
+            self._wake()
+
+    def remove(self, dl):
+        with self._lock:
+            dl._done = True
+            if dl in self._sigint:
+                self._sigint.remove(dl)
+
+    def _wake(self):
+        if _use_pipes:
+            try:
+                os.write(self.wakeup_fd, bytes(bytearray([_WAKE])))
+            except OSError as e:  # pipe is full, so it will wake up anyway
+                if e.errno != errno.EAGAIN:
+                    raise
+        else:
+            self._event.set()
+
+    def _sleep(self, timeout):
+        """Waits for the timeout or a write on the pipe.
+
+        Returns True if Ctrl-C was pressed.
+        """
+        if not _use_pipes:
+            self._event.wait(timeout)
+            self._event.clear()
+            return False
+
+        try:
+            readable, _, _ = select.select([self.wakeup_fd_read], [], [],
+                                           timeout)
+        except (select.error, OSError) as e:
+            if e.args[0] == errno.EINTR:
+                return False
+            raise
+        sigint = False
+        while readable:
+            try:
+                data = os.read(self.wakeup_fd_read, 512)
+            except OSError as e:
+                if e.errno == errno.EAGAIN:
+                    break
+                raise
+            sigint = sigint or any(_is_sigint(b) for b in bytearray(data))
+            if len(data) < 512:
+                break
+        return sigint
+
+    def _run(self):
+        while True:
+            with self._lock:
+                now = time.time()
+                while self._heap and (self._heap[0][2]._done or
+                                      self._heap[0][0] <= now):
+                    _, _, dl = heapq.heappop(self._heap)
+                    if not dl._done:
+                        dl.expired = True
+                        dl._java_thread.interrupt()
+                timeout = None
+                if self._heap:
+                    timeout = self._heap[0][0] - now
+            if self._sleep(timeout):
+                with self._lock:
+                    # KeyboardInterrupt might be raised before __exit__()
+                    # runs, so these deadlines are ended here
+                    for dl in self._sigint:
+                        dl.interrupted = True
+                        dl._done = True
+                        dl._java_thread.interrupt()
+                    self._sigint = []
+
+
+_watchdog = None
+_watchdog_lock = threading.Lock()
+
+
+def _get_watchdog():
+    global _watchdog
+    with _watchdog_lock:
+        if _watchdog is None:
+            _watchdog = _Watchdog()
+        return _watchdog
+
+
+class deadline(object):
+    """Interrupts the Java calls of a block after some time, or on Ctrl-C.
+
+    with pyjava.deadline(0.5):
+        result = service.query(request)
+
+    If a Java exception is raised after the deadline expired, TimeoutError is
+    raised instead. seconds can be None to only handle Ctrl-C; this works from
+    the main thread, if SIGINT has Python's default handler, and Python raises
+    KeyboardInterrupt as usual once the Java call returns.
+
+    A single watchdog thread serves all the deadlines; entering and exiting a
+    block only adds and removes it.
+
+    The 'expired' and 'interrupted' attributes tell what the watchdog did.
+    """
+    def __init__(self, seconds=None):
+        self.seconds = seconds
+        self.expired = False
+        self.interrupted = False
+        self._registered = False
+
+    def __enter__(self):
+        self.expired = self.interrupted = False
+        self._done = False
+        self._watch_sigint = _can_watch_sigint()
+        self._previous_wakeup_fd = None
+        if self.seconds is None and not self._watch_sigint:
+            return self
+
+        Thread = _pyjava.getclass('java/lang/Thread')
+        self._java_thread = Thread.currentThread()
+        if self.seconds is not None:
+            self._expiry = time.time() + self.seconds
+        watchdog = _get_watchdog()
+        if self._watch_sigint:
+            self._previous_wakeup_fd = signal.set_wakeup_fd(
+                    watchdog.wakeup_fd)
+        watchdog.add(self)
+        self._registered = True
+        return self
+
+    def __exit__(self, exc_type, exc_value, tb):
+        if self._registered:
+            _watchdog.remove(self)
+            if self._previous_wakeup_fd is not None:
+                signal.set_wakeup_fd(self._previous_wakeup_fd)
+            self._registered = False
+            self._java_thread = None
+
+        if self.expired or self.interrupted:
+            # The call might have returned without seeing the interrupt
+            _pyjava.getclass('java/lang/Thread').interrupted()
+            if (self.expired and exc_type is not None and
+                    issubclass(exc_type, _pyjava.Error)):
+                raise TimeoutError("deadline of %g seconds expired" %
+                                   self.seconds)
+        return False
@@ -108,6 +108,7 @@ setup(name='PyJava',
       ext_modules=[pyjava],
       package_dir={'': 'python'},
       packages=['pyjava'],
+      install_requires=['futures; python_version < "3"'],
       description='Python-Java bridge',
       author="Remi Rampin",
       author_email='remirampin@gmail.com',
@@ -0,0 +1,149 @@
+"""Tests for the asynchronous and interruptible calls of the pyjava package.
+"""
+
+
+import os
+import signal
+import threading
+import time
+
+import pyjava
+
+from base import PyjavaTestCase, unittest
+
+
+class Test_submit(PyjavaTestCase):
+    def test_calls(self):
+        """Runs Java calls on the worker pool.
+        """
+        String = pyjava.getclass('java.lang.String')
+        Integer = pyjava.getclass('java.lang.Integer')
+        futures = [pyjava.submit(Integer.parseInt, u'%d' % i)
+                   for i in xrange(16)]
+        self.assertEqual([f.result(10) for f in futures], range(16))
+        s = String(u'abc')
+        self.assertEqual(pyjava.submit(s.concat, u'd').result(10), u'abcd')
+
+        stats = pyjava.stats()
+        self.assertGreaterEqual(stats['pool_workers'], 1)
+        self.assertGreaterEqual(stats['pool_submitted'], 17)
+        self.assertGreaterEqual(stats['pool_completed'], 17)
+        self.assertTrue('overload_cache_hits' in stats)
+
+    def test_exception(self):
+        """Checks that errors are set on the future.
+        """
+        Integer = pyjava.getclass('java.lang.Integer')
+        future = pyjava.submit(Integer.parseInt, 1, 2, 3)
+        self.assertTrue(isinstance(future.exception(10),
+                                   pyjava.NoMatchingOverload))
+
+
+class Test_java_future(PyjavaTestCase):
+    def test_completed(self):
+        """Waits for CompletableFutures.
+        """
+        CompletableFuture = pyjava.getclass(
+                'java.util.concurrent.CompletableFuture')
+        RuntimeException = pyjava.getclass('java.lang.RuntimeException')
+        future = pyjava.java_future(CompletableFuture.completedFuture(u'ok'))
+        self.assertEqual(future.result(10), u'ok')
+
+        failed = CompletableFuture()
+        future = pyjava.java_future(failed)
+        failed.completeExceptionally(RuntimeException(u'boom'))
+        exception = future.exception(10)
+        self.assertTrue(isinstance(exception, pyjava.CompletionError))
+        self.assertTrue(isinstance(exception.throwable, RuntimeException))
+
+    def test_pool_unaffected(self):
+        """Waits for more stages than there are workers, while using submit().
+        """
+        CompletableFuture = pyjava.getclass(
+                'java.util.concurrent.CompletableFuture')
+        pyjava.submit(lambda: None).result(10)
+        workers = pyjava.stats()['pool_workers']
+        stages = [CompletableFuture() for i in xrange(workers + 2)]
+        futures = [pyjava.java_future(stage) for stage in stages]
+        # The last stage is completed by the pool
+        self.assertTrue(pyjava.submit(stages[-1].complete, u'pool').result(10))
+        self.assertEqual(futures[-1].result(10), u'pool')
+        self.assertEqual(pyjava.stats()['pool_workers'], workers)
+        for i, stage in enumerate(stages[:-1]):
+            stage.complete(u'%d' % i)
+        self.assertEqual([f.result(10) for f in futures[:-1]],
+                         [u'%d' % i for i in xrange(len(stages) - 1)])
+
+    def test_one_thread(self):
+        """Waits for many stages from a single thread.
+        """
+        CompletableFuture = pyjava.getclass(
+                'java.util.concurrent.CompletableFuture')
+        before = pyjava.stats()['threads_attached']
+        stages = [CompletableFuture() for i in xrange(20)]
+        futures = [pyjava.java_future(stage) for stage in stages]
+        for i, stage in enumerate(stages):
+            stage.complete(u'%d' % i)
+        self.assertEqual([f.result(10) for f in futures],
+                         [u'%d' % i for i in xrange(20)])
+        self.assertLessEqual(pyjava.stats()['threads_attached'], before + 1)
+
+    def test_asyncio(self):
+        """Awaits a CompletableFuture from an event loop.
+        """
+        try:
+            from pyjava.aio import asyncio, wrap_future
+        except ImportError:
+            raise unittest.SkipTest("asyncio is not available")
+        CompletableFuture = pyjava.getclass(
+                'java.util.concurrent.CompletableFuture')
+        stage = CompletableFuture()
+        loop = asyncio.new_event_loop()
+        try:
+            aio_future = wrap_future(stage, loop=loop)
+            loop.call_later(0.1, stage.complete, u'done')
+            self.assertEqual(loop.run_until_complete(aio_future), u'done')
+        finally:
+            loop.close()
+
+
+class Test_deadline(PyjavaTestCase):
+    def test_expired(self):
+        """Interrupts a sleeping call.
+        """
+        Thread = pyjava.getclass('java.lang.Thread')
+        start = time.time()
+        with self.assertRaises(pyjava.TimeoutError):
+            with pyjava.deadline(0.2) as d:
+                Thread.sleep(5000)
+        self.assertLess(time.time() - start, 4.0)
+        self.assertTrue(d.expired)
+        self.assertFalse(Thread.currentThread().isInterrupted())
+
+    def test_in_time(self):
+        """Leaves calls that finish in time alone.
+        """
+        Thread = pyjava.getclass('java.lang.Thread')
+        with pyjava.deadline(5) as d:
+            Thread.sleep(10)
+        self.assertFalse(d.expired)
+        self.assertFalse(Thread.currentThread().isInterrupted())
+
+    def test_ctrl_c(self):
+        """Interrupts a sleeping call on Ctrl-C.
+        """
+        if os.name != 'posix':
+            raise unittest.SkipTest("Ctrl-C is only watched on POSIX")
+        Thread = pyjava.getclass('java.lang.Thread')
+        timer = threading.Timer(0.2, os.kill, (os.getpid(), signal.SIGINT))
+        start = time.time()
+        timer.start()
+        try:
+            with self.assertRaises(KeyboardInterrupt):
+                with pyjava.deadline() as d:
+                    Thread.sleep(5000)
+        finally:
+            timer.join()
+        self.assertLess(time.time() - start, 4.0)
+        self.assertTrue(d.interrupted)
+        self.assertFalse(Thread.currentThread().isInterrupted())
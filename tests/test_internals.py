@@ -7,6 +7,9 @@ the pyjava Python interface, the package is covered by tests.
 
 
 import math
+import struct
+import threading
+import time
 
 import _pyjava
 
@@ -51,7 +54,6 @@ class Test_classobject(PyjavaTestCase):
             class MyString(String):
                 pass
 
-    @unittest.skip("JavaClass is not a metaclass right now")
     def test_issubclass(self):
         """Requests well-known classes and tests issubclass().
         """
@@ -71,7 +73,6 @@ class Test_classobject(PyjavaTestCase):
         self.assertFalse(issubclass(String, list))
         self.assertFalse(issubclass(int, Class))
 
-    @unittest.skip("JavaClass is not a metaclass right now")
     def test_isinstance(self):
         """Requests well-known classes and tests isinstance().
         """
@@ -84,6 +85,26 @@ class Test_classobject(PyjavaTestCase):
         self.assertFalse(isinstance(2, List))
         self.assertFalse(isinstance(empty, list))
 
+    def test_class_type(self):
+        """Checks the Python type generated for a Java class.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        Object = _pyjava.getclass('java/lang/Object')
+        CharSequence = _pyjava.getclass('java/lang/CharSequence')
+        self.assertIs(_pyjava.getclass('java/lang/String'), String)
+        self.assertEqual(String.__name__, 'String')
+        self.assertEqual(String.__module__, 'java.lang')
+        self.assertIn(Object, String.__mro__)
+        self.assertIn(CharSequence, String.__mro__)
+        self.assertIn('length', String.__dict__)
+        s = String(u'lala')
+        self.assertIs(type(s), String)
+        self.assertEqual(s.length(), 4)
+        with self.assertRaises(AttributeError):
+            s.nonexistent
+        with self.assertRaises(AttributeError):
+            s.length = 2
+
     def test_is_same_object(self):
         """Tests for equality of references.
         """
@@ -126,6 +147,21 @@ class Test_get_method(PyjavaTestCase):
         self.assertIsNotNone(sin)
         self.assertTrue(isinstance(sin, _pyjava.UnboundMethod))
 
+    def test_shared_overloads(self):
+        """Requests the same method several times.
+
+        The overloads are shared between the wrappers and have to stay valid
+        after some of them are destroyed.
+        """
+        Vector = _pyjava.getclass('java/util/Vector')
+        v = Vector(10)
+        capacity = v.capacity
+        self.assertEqual(capacity(), 10)
+        del capacity
+        self.assertEqual(v.capacity(), 10)
+        self.assertEqual(Vector.capacity(v), 10)
+        self.assertEqual(Vector(5).capacity(), 5)
+
 
 class Test_call(PyjavaTestCase):
     def test_constructor(self):
@@ -150,6 +186,18 @@ class Test_call(PyjavaTestCase):
         self.assertEqual(size(li), 0)
         self.assertEqual(b_size(), 0)
 
+    def test_boundmethod_args(self):
+        """Calls bound methods with arguments.
+        """
+        Vector = _pyjava.getclass('java/util/Vector')
+        vector = Vector(10)
+        ensureCapacity = vector.ensureCapacity
+        ensureCapacity(15)
+        self.assertGreaterEqual(vector.capacity(), 15)
+        vector.setSize(3)
+        self.assertEqual(vector.size(), 3)
+        self.assertIsNone(vector.get(2))
+
     def test_staticmethod(self):
         """Calls a well-known static method.
         """
@@ -168,6 +216,79 @@ class Test_call(PyjavaTestCase):
             sin()
 
 
+class Test_overload_cache(PyjavaTestCase):
+    def test_cached_resolution(self):
+        """Calls an overloaded method repeatedly with the same types.
+        """
+        Math = _pyjava.getclass('java/lang/Math')
+        hits = _pyjava.stats()['overload_cache_hits']
+        for i in xrange(5):
+            self.assertEqual(Math.max(i, 2), max(i, 2))
+            self.assertAlmostEqual(Math.max(i, 2.5), max(i, 2.5))
+        self.assertGreaterEqual(_pyjava.stats()['overload_cache_hits'],
+                                hits + 8)
+
+    def test_range(self):
+        """Checks that the range of integers is validated on cached calls.
+        """
+        Byte = _pyjava.getclass('java/lang/Byte')
+        self.assertEqual(Byte.toString(5), u'5')
+        self.assertEqual(Byte.toString(6), u'6')
+        with self.assertRaises(_pyjava.NoMatchingOverload):
+            Byte.toString(300)
+
+
+class Test_assignable_cache(PyjavaTestCase):
+    def test_cached_check(self):
+        """Passes objects of the same class repeatedly.
+        """
+        List = _pyjava.getclass('java/util/List')
+        Vector = _pyjava.getclass('java/util/Vector')
+        Collections = _pyjava.getclass('java/util/Collections')
+        unmodifiable = Collections.unmodifiableList.overload(
+                '(Ljava/util/List;)Ljava/util/List;')
+        hits = _pyjava.stats()['assignable_cache_hits']
+        for i in xrange(5):
+            self.assertEqual(unmodifiable(Vector(i)).size(), 0)
+        self.assertGreaterEqual(_pyjava.stats()['assignable_cache_hits'],
+                                hits + 4)
+        self.assertTrue(issubclass(Vector, List))
+
+
+class Test_method_handle(PyjavaTestCase):
+    def test_static(self):
+        """Selects an overload of a static method.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        valueOf = String.valueOf.overload('(I)Ljava/lang/String;')
+        self.assertIsInstance(valueOf, _pyjava.MethodHandle)
+        self.assertEqual(valueOf(42), u'42')
+        Math = _pyjava.getclass('java/lang/Math')
+        self.assertAlmostEqual(Math.max.overload('(DD)D')(1, 2.5), 2.5)
+
+    def test_nonstatic(self):
+        """Selects a non-static method, bound or unbound.
+        """
+        Vector = _pyjava.getclass('java/util/Vector')
+        v = Vector(10)
+        self.assertEqual(v.capacity.overload('()I')(), 10)
+        self.assertEqual(Vector.capacity.overload('()I')(v), 10)
+
+    def test_errors(self):
+        """Uses wrong signatures and wrong arguments.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        with self.assertRaises(_pyjava.NoMatchingOverload):
+            String.valueOf.overload('(Z)I')
+        with self.assertRaises(_pyjava.NoMatchingOverload):
+            String.valueOf.overload('garbage')
+        valueOf = String.valueOf.overload('(I)Ljava/lang/String;')
+        with self.assertRaises(TypeError):
+            valueOf(u'test')
+        with self.assertRaises(TypeError):
+            valueOf()
+
+
 class Test_get_field(PyjavaTestCase):
     def test_field(self):
         """Requests a well-known field.
@@ -203,6 +324,23 @@ class Test_get_field(PyjavaTestCase):
         with self.assertRaises(AttributeError):
             Math.nonExistentField
 
+    def test_repeated(self):
+        """Accesses the same fields several times.
+
+        Lookups are cached, including the failed ones.
+        """
+        Dimension = _pyjava.getclass('java/awt/Dimension')
+        d1 = Dimension()
+        d2 = Dimension()
+        for i in xrange(3):
+            d1.width = i
+            self.assertEqual(d1.width, i)
+            self.assertEqual(d2.width, 0)
+            with self.assertRaises(AttributeError):
+                d1.nonExistentField
+            with self.assertRaises(AttributeError):
+                Dimension.width
+
 
 class Test_set_field(PyjavaTestCase):
     def test_field(self):
@@ -379,3 +517,428 @@ class Test_conversions(PyjavaTestCase):
         o = C(17)
         m = C.i_
         self.assertEqual(m(o), 42)
+
+
+class Test_strings(PyjavaTestCase):
+    def test_roundtrip(self):
+        """Passes strings to Java and gets them back.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        for s in [u'', u'abc', u'\xE9t\xE9', u'a\x00b', u'\u05D0\u252C',
+                  u'x\U0001F600y']:
+            self.assertEqual(String(s).concat(u'!'), s + u'!')
+
+    def test_surrogates(self):
+        """Checks that characters outside the BMP are surrogate pairs in Java.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        s = String(u'a\U0001F600')
+        self.assertEqual(s.length(), 3)
+        self.assertEqual(s.codePointAt(1), 0x1F600)
+
+    def test_declared_types(self):
+        """Gets strings back through String, Object and interface types.
+        """
+        ArrayList = _pyjava.getclass('java/util/ArrayList')
+        l = ArrayList()
+        l.add(u'abc')
+        l.add(ArrayList())
+        # Object return type: each result is checked
+        self.assertEqual(l.get(0), u'abc')
+        self.assertTrue(isinstance(l.get(1), ArrayList))
+        # String return type
+        self.assertEqual(l.toString(), u'[abc, []]')
+        # CharSequence return type
+        String = _pyjava.getclass('java/lang/String')
+        self.assertEqual(String(u'abc').subSequence(1, 2), u'b')
+
+
+class Test_array_buffer(PyjavaTestCase):
+    def test_read(self):
+        """Reads a primitive array through a memoryview.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        a = String(u'abc').toCharArray()
+        self.assertTrue(isinstance(a, _pyjava.JavaArray))
+        m = memoryview(a)
+        self.assertEqual(m.format, 'H')
+        self.assertEqual(m.itemsize, 2)
+        self.assertEqual(len(m), 3)
+        self.assertEqual(struct.unpack('=3H', m.tobytes()),
+                         (ord('a'), ord('b'), ord('c')))
+        del m
+
+    def test_write(self):
+        """Changes a Java array in place.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        a = String(u'abc').getBytes()
+        m = memoryview(a)
+        m[1] = b'x'
+        del m
+        self.assertEqual(String(a), u'axc')
+
+        with a:
+            m = memoryview(a)
+            m[0] = b'y'
+            del m
+            a.commit()
+            self.assertEqual(String(a), u'yxc')
+            m = memoryview(a)
+            m[2] = b'z'
+            del m
+        self.assertEqual(String(a), u'yxz')
+
+    def test_object_array(self):
+        """Checks that object arrays don't export buffers.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        a = String(u'a,b').split(u',')
+        self.assertRaises(TypeError, memoryview, a)
+
+
+class Test_buffer_params(PyjavaTestCase):
+    def test_in(self):
+        """Passes buffers as primitive arrays.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        self.assertEqual(String(bytearray(b'abc')), u'abc')
+        self.assertEqual(String(b'def'), u'def')
+
+        Arrays = _pyjava.getclass('java/util/Arrays')
+        b = bytearray(b'cab')
+        Arrays.sort(b)
+        self.assertEqual(b, bytearray(b'cab'))
+
+    def test_inout(self):
+        """Gets arrays back into buffers.
+        """
+        Arrays = _pyjava.getclass('java/util/Arrays')
+        b = bytearray(b'cab')
+        Arrays.sort(_pyjava.inout(b))
+        self.assertEqual(b, bytearray(b'abc'))
+        Arrays.fill(_pyjava.inout(b), 7)
+        self.assertEqual(b, bytearray(b'\x07\x07\x07'))
+
+    def test_format(self):
+        """Checks that the format of the buffer has to match.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        chars = memoryview(String(u'ab').toCharArray())
+        self.assertEqual(String.copyValueOf(chars), u'ab')
+        del chars
+        self.assertRaises(_pyjava.NoMatchingOverload,
+                          String.copyValueOf, bytearray(b'ab'))
+        self.assertRaises(TypeError, _pyjava.inout, 42)
+
+
+class Test_bytebuffer(PyjavaTestCase):
+    def test_share(self):
+        """Shares a bytearray with Java.
+        """
+        b = bytearray(b'abc')
+        bb = _pyjava.bytebuffer(b)
+        self.assertTrue(bb.isDirect())
+        self.assertEqual(bb.capacity(), 3)
+        self.assertEqual(bb.get(1), ord('b'))
+        bb.put(0, ord('x'))
+        self.assertEqual(b, bytearray(b'xbc'))
+        self.assertRaises(BufferError, _pyjava.bytebuffer, b'abc')
+
+    def test_release(self):
+        """Releases a shared buffer once Java collected its ByteBuffer.
+        """
+        System = _pyjava.getclass('java/lang/System')
+        b = bytearray(b'abc')
+        before = _pyjava.stats()['shared_buffers']
+        bb = _pyjava.bytebuffer(b)
+        self.assertEqual(_pyjava.stats()['shared_buffers'], before + 1)
+        self.assertRaises(BufferError, b.extend, b'd')
+        del bb
+        for i in xrange(10):
+            System.gc()
+            if _pyjava.stats()['shared_buffers'] == before:
+                break
+            time.sleep(0.1)
+        self.assertEqual(_pyjava.stats()['shared_buffers'], before)
+        b.extend(b'd')
+        self.assertEqual(b, bytearray(b'abcd'))
+
+    def test_param(self):
+        """Passes a bytearray for a ByteBuffer parameter.
+        """
+        Charset = _pyjava.getclass('java/nio/charset/Charset')
+        utf8 = Charset.forName(u'UTF-8')
+        self.assertEqual(utf8.decode(bytearray(b'abc')).toString(), u'abc')
+
+    def test_direct(self):
+        """Accesses a direct ByteBuffer from Python.
+        """
+        ByteBuffer = _pyjava.getclass('java/nio/ByteBuffer')
+        bb = ByteBuffer.allocateDirect(4)
+        m = memoryview(bb)
+        self.assertEqual(len(m), 4)
+        self.assertFalse(m.readonly)
+        m[2] = b'\x05'
+        self.assertEqual(bb.get(2), 5)
+        del m
+        self.assertTrue(memoryview(bb.asReadOnlyBuffer()).readonly)
+
+        bb = ByteBuffer.allocate(4)
+        self.assertRaises(BufferError, memoryview, bb)
+
+
+class Test_array_sequence(PyjavaTestCase):
+    def test_strings(self):
+        """Accesses a String[] as a sequence.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        a = String(u'a,b,c').split(u',')
+        self.assertEqual(len(a), 3)
+        self.assertEqual(a[0], u'a')
+        self.assertEqual(a[-1], u'c')
+        self.assertRaises(IndexError, lambda: a[3])
+        self.assertEqual(a[::2], [u'a', u'c'])
+        self.assertEqual(list(a), [u'a', u'b', u'c'])
+        self.assertEqual(a.tolist(), [u'a', u'b', u'c'])
+
+    def test_objects(self):
+        """Accesses an Object[] with more than one chunk.
+        """
+        ArrayList = _pyjava.getclass('java/util/ArrayList')
+        Integer = _pyjava.getclass('java/lang/Integer')
+        l = ArrayList()
+        for i in xrange(150):
+            l.add(Integer(i) if i % 2 else u'%d' % i)
+        a = l.toArray()
+        items = list(a)
+        self.assertEqual(len(items), 150)
+        self.assertEqual(items[4], u'4')
+        self.assertTrue(isinstance(items[5], Integer))
+        self.assertEqual(items[149].intValue(), 149)
+        self.assertEqual(a.tolist()[148], u'148')
+
+    def test_primitive(self):
+        """Checks that primitive arrays only support len().
+        """
+        String = _pyjava.getclass('java/lang/String')
+        a = String(u'ab').toCharArray()
+        self.assertEqual(len(a), 2)
+        self.assertRaises(TypeError, lambda: a[0])
+
+
+class Test_local_frames(PyjavaTestCase):
+    def test_frames(self):
+        """Checks that calls run in local frames, which get popped.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        s = String(u'abc')
+        before = _pyjava.stats()
+        for i in xrange(10000):
+            self.assertEqual(s.concat(u'd'), u'abcd')
+        after = _pyjava.stats()
+        self.assertGreaterEqual(after['local_frames'],
+                                before['local_frames'] + 10000)
+        self.assertEqual(after['local_frames_depth_peak'],
+                         before['local_frames_depth_peak'])
+        self.assertGreater(after['local_refs_peak'], 0)
+
+
+class Test_freelists(PyjavaTestCase):
+    def test_reuse(self):
+        """Checks that wrappers are reused once freed.
+        """
+        ArrayList = _pyjava.getclass('java/util/ArrayList')
+        l = ArrayList()
+        l.add(u'a')
+        before = _pyjava.stats()['freelist_hits']
+        for i in xrange(100):
+            size = l.size
+            self.assertEqual(size(), 1)
+            self.assertTrue(isinstance(l.subList(0, 1), _pyjava.JavaInstance))
+        self.assertGreaterEqual(_pyjava.stats()['freelist_hits'],
+                                before + 200)
+        self.assertEqual(l.get(0), u'a')
+
+
+class Test_identity_cache(PyjavaTestCase):
+    def tearDown(self):
+        _pyjava.identity_cache(False)
+
+    def test_identity(self):
+        """Checks that the same object gets the same wrapper.
+        """
+        ArrayList = _pyjava.getclass('java/util/ArrayList')
+        Object = _pyjava.getclass('java/lang/Object')
+        o = Object()
+        l = ArrayList()
+        l.add(o)
+        self.assertFalse(l.get(0) is l.get(0))
+
+        self.assertFalse(_pyjava.identity_cache(True))
+        before = _pyjava.stats()
+        a = l.get(0)
+        self.assertTrue(l.get(0) is a)
+        after = _pyjava.stats()
+        self.assertEqual(after['identity_cache_hits'],
+                         before['identity_cache_hits'] + 1)
+        self.assertEqual(after['identity_cache_size'],
+                         before['identity_cache_size'] + 1)
+
+        # Wrappers leave the map when freed
+        del a
+        self.assertEqual(_pyjava.stats()['identity_cache_size'],
+                         before['identity_cache_size'])
+
+        o2 = Object()
+        l.add(o2)
+        self.assertTrue(l.get(1) is o2)
+        self.assertTrue(_pyjava.identity_cache(False))
+        self.assertEqual(_pyjava.stats()['identity_cache_size'], 0)
+
+
+class Test_scope(PyjavaTestCase):
+    def test_release(self):
+        """Checks that objects are released when their scope exits.
+        """
+        ArrayList = _pyjava.getclass('java/util/ArrayList')
+        Integer = _pyjava.getclass('java/lang/Integer')
+        before = _pyjava.stats()['scope_released']
+        with _pyjava.scope() as s:
+            l = ArrayList()
+            l.add(Integer(4))
+            i = l.get(0)
+            kept = s.keep(ArrayList())
+            self.assertEqual(i.intValue(), 4)
+        self.assertEqual(_pyjava.stats()['scope_released'], before + 2)
+        self.assertRaises(_pyjava.Error, lambda: l.size)
+        self.assertRaises(_pyjava.Error, lambda: i.intValue())
+        self.assertEqual(kept.size(), 0)
+        self.assertFalse(l == i)
+
+    def test_local(self):
+        """Uses a scope in local references mode.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        Object = _pyjava.getclass('java/lang/Object')
+        with _pyjava.scope(local=True) as s:
+            for i in xrange(1000):
+                o = Object()
+                self.assertEqual(String.valueOf(o)[:17], u'java.lang.Object@')
+            kept = s.keep(Object())
+            o2 = Object()
+        self.assertRaises(_pyjava.Error, lambda: o2.hashCode())
+        self.assertTrue(isinstance(kept.hashCode(), int))
+
+    def test_nesting(self):
+        """Checks that scopes must exit in order.
+        """
+        outer = _pyjava.scope()
+        inner = _pyjava.scope()
+        outer.__enter__()
+        inner.__enter__()
+        self.assertRaises(RuntimeError, outer.__exit__, None, None, None)
+        inner.__exit__(None, None, None)
+        outer.__exit__(None, None, None)
+        self.assertRaises(RuntimeError, outer.__exit__, None, None, None)
+
+    def test_bound_method(self):
+        """Calls a method that was bound in a scope after it exited.
+        """
+        ArrayList = _pyjava.getclass('java/util/ArrayList')
+        with _pyjava.scope():
+            l = ArrayList()
+            size = l.size
+            self.assertEqual(size(), 0)
+        self.assertRaises(_pyjava.Error, size)
+        self.assertRaises(_pyjava.Error, size.overload, '()I')
+
+    def test_array_iterator(self):
+        """Advances an iterator over an array after its scope exited.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        with _pyjava.scope():
+            a = String(u','.join([u'x'] * 100)).split(u',')
+            it = iter(a)
+            self.assertEqual(next(it), u'x')
+        for i in xrange(63):
+            self.assertEqual(next(it), u'x')
+        self.assertRaises(_pyjava.Error, next, it)
+        self.assertRaises(_pyjava.Error, lambda: a[70:80])
+
+
+class Test_threads(PyjavaTestCase):
+    def test_attach(self):
+        """Calls Java from other threads, which get attached.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        s = String(u'abc')
+        before = _pyjava.stats()['threads_attached']
+        results = []
+
+        def run(i):
+            Integer = _pyjava.getclass('java/lang/Integer')
+            results.append((s.concat(u'%d' % i), Integer(i).intValue()))
+
+        threads = [threading.Thread(target=run, args=(i,)) for i in xrange(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(sorted(results),
+                         [(u'abc%d' % i, i) for i in xrange(4)])
+        self.assertEqual(_pyjava.stats()['threads_attached'], before + 4)
+
+    def test_release_gil(self):
+        """Checks that Java calls from several threads run concurrently.
+        """
+        Thread = _pyjava.getclass('java/lang/Thread')
+
+        def run():
+            Thread.sleep(300)
+
+        threads = [threading.Thread(target=run) for i in xrange(4)]
+        start = time.time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertLess(time.time() - start, 1.0)
+
+    def test_opt_out(self):
+        """Disables the release of the GIL, globally and for a handle.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        self.assertTrue(_pyjava.release_gil(False))
+        try:
+            self.assertEqual(String(u'abc').length(), 3)
+        finally:
+            self.assertFalse(_pyjava.release_gil(True))
+        length = String(u'abcd').length.overload('()I')
+        self.assertTrue(length.release_gil)
+        length.release_gil = False
+        self.assertEqual(length(), 4)
+
+
+class Test_exceptions(PyjavaTestCase):
+    def test_java_exception(self):
+        """Raises Java exceptions as JavaException.
+        """
+        Integer = _pyjava.getclass('java/lang/Integer')
+        Thread = _pyjava.getclass('java/lang/Thread')
+        self.assertRaises(_pyjava.JavaException, Integer.parseInt, u'abc')
+        self.assertEqual(Integer.parseInt(u'12'), 12)
+
+        Thread.currentThread().interrupt()
+        self.assertRaises(_pyjava.Interrupted, Thread.sleep, 1000)
+
+    def test_class_method(self):
+        """Raises exceptions thrown by Class methods called on a class.
+        """
+        String = _pyjava.getclass('java/lang/String')
+        try:
+            String.getField(u'nope')
+        except _pyjava.JavaException as e:
+            self.assertTrue('NoSuchFieldException' in unicode(e))
+        else:
+            self.fail("NoSuchFieldException wasn't raised")